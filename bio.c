@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -13,46 +13,193 @@
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 //
-// The implementation uses two state flags internally:
+// The implementation uses these state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_ASYNC: nobody is waiting for the disk request;
+//     the disk driver releases the buffer with biodone().
+//
+// Each hash bucket has its own lock, so lookups of different
+// blocks do not contend.  A miss recycles an unused buffer
+// chosen by a clock sweep over all buffers; bcache.lock
+// serializes misses, so a block cannot be given two buffers.
+//
+// The buffers and their data are allocated with kalloc() at
+// boot; binit() sizes the cache from the free memory, up to NBUF.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 257
+#define BCACHEFRAC 8  // use 1/BCACHEFRAC of free memory
+#define MINBUF (4*LOGSIZE)  // pinned and copied log blocks, and then some
+#define NAHEAD 32     // max read-ahead blocks per disk submission
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;  // list of buffers through prev/next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes misses
+  int nbuf;
+  struct buf *hand;      // clock hand, on the ring through cnext
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev*31 + blockno) % NBUCKET];
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Must be called after kinit2(), when all of memory is free.
 void
 binit(void)
 {
-  struct buf *b;
+  struct buf *b, *bufs, *last;
+  struct bucket *bk;
+  char *data;
+  int i, nb, nd;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  bcache.nbuf = kfreecount() / BCACHEFRAC * (PGSIZE/BSIZE);
+  if(bcache.nbuf > NBUF)
+    bcache.nbuf = NBUF;
+  if(bcache.nbuf < MINBUF)
+    panic("binit: no memory");
+
+  // Carve buffers and their data out of whole pages, linking
+  // them into a ring for the clock sweep.  All buffers start
+  // out as block 0 of device 0.
+  bk = bhash(0, 0);
+  last = 0;
+  nb = nd = 0;
+  bufs = 0;
+  data = 0;
+  for(i = 0; i < bcache.nbuf; i++){
+    if(nb == 0){
+      if((bufs = (struct buf*)kalloc()) == 0)
+        panic("binit: kalloc");
+      memset(bufs, 0, PGSIZE);
+      nb = PGSIZE / sizeof(struct buf);
+    }
+    if(nd == 0){
+      if((data = kalloc()) == 0)
+        panic("binit: kalloc");
+      nd = PGSIZE / BSIZE;
+    }
+    b = bufs++;
+    nb--;
+    b->data = (uchar*)data;
+    data += BSIZE;
+    nd--;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    blink(bk, b);
+    if(last)
+      last->cnext = b;
+    else
+      bcache.hand = b;
+    last = b;
+  }
+  last->cnext = bcache.hand;
+}
+
+// Look for block on device dev in bucket bk, which must be locked.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Whether processes have b's data page mapped with mmap().
+static int
+bmapped(struct buf *b)
+{
+  return BSIZE == PGSIZE && krefcnt((char*)b->data) > 1;
+}
+
+// Give b a new data page, leaving the old one to the processes
+// that map it.
+static int
+bunmap(struct buf *b)
+{
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  kfree((char*)b->data);
+  b->data = (uchar*)mem;
+  return 0;
+}
+
+// Find an unused buffer with the clock algorithm, skipping
+// (and clearing) recently used ones, and remove it from its bucket.
+// Buffers whose pages are mapped are only taken on the second lap.
+// Caller must hold bcache.lock, which keeps the buffers' identities
+// and so their buckets stable.
+static struct buf*
+brecycle(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int n;
+
+  for(n = 0; n < 2*bcache.nbuf; n++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0){
+      if(b->used)
+        b->used = 0;
+      else if(bmapped(b) && (n < bcache.nbuf || bunmap(b) < 0))
+        ;  // spare pages that processes map, for one lap
+      else {
+        b->refcnt = 1;
+        bunlink(b);
+        release(&bk->lock);
+        return b;
+      }
+    }
+    release(&bk->lock);
   }
+  panic("bget: no buffers");
 }
 
 // Look through buffer cache for block on device dev.
@@ -62,34 +209,35 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0)
+    b->refcnt++;
+  release(&bk->lock);
+  if(b == 0){
+    // Not cached; recycle an unused buffer.  Look again once
+    // misses are serialized, in case another process just
+    // read the block in.
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+    if((b = blookup(bk, dev, blockno)) != 0)
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
-
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
+    release(&bk->lock);
+    if(b == 0){
+      b = brecycle();
       b->dev = dev;
       b->blockno = blockno;
       b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      acquire(&bk->lock);
+      blink(bk, b);
+      release(&bk->lock);
     }
+    release(&bcache.lock);
   }
-  panic("bget: no buffers");
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -105,6 +253,56 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block filled with
+// zeros instead of read from disk, for a newly allocated block.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  memset(b->data, 0, BSIZE);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Start reading the n indicated blocks into the cache, but do
+// not wait for them.  The reads are handed to the disk driver
+// together so that adjacent blocks are read by one command.
+// The driver releases each buffer when its read completes.
+void
+breadahead(uint dev, uint *blocks, int n)
+{
+  struct buf *b, *bv[NAHEAD];
+  struct bucket *bk;
+  int i, nb;
+
+  nb = 0;
+  for(i = 0; i < n; i++){
+    // Nothing to do if the block is cached, and no point
+    // waiting for a process that is using it.
+    bk = bhash(dev, blocks[i]);
+    acquire(&bk->lock);
+    b = blookup(bk, dev, blocks[i]);
+    release(&bk->lock);
+    if(b != 0)
+      continue;
+
+    b = bget(dev, blocks[i]);
+    if(b->flags & B_VALID){
+      brelse(b);
+      continue;
+    }
+    b->flags |= B_ASYNC;
+    bv[nb++] = b;
+    if(nb == NAHEAD){
+      iderwv(bv, nb);
+      nb = 0;
+    }
+  }
+  iderwv(bv, nb);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,30 +313,67 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Mark b recently used so the clock sweep passes it over once.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+
+  releasesleep(&b->lock);
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  if(b->refcnt == 0)
+    b->used = 1;
+  release(&bk->lock);
+}
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
+  bput(b);
+}
 
-  releasesleep(&b->lock);
+// Called by the disk driver when a B_ASYNC request for b
+// completes, possibly from an interrupt: release b on behalf
+// of the process that started the request.
+void
+biodone(struct buf *b)
+{
+  if((b->flags & B_ASYNC) == 0)
+    panic("biodone");
+  b->flags &= ~B_ASYNC;
+  bput(b);
+}
+
+// Keep b in the cache, even once it is released, until
+// bunpin().  The log pins the blocks it has yet to install.
+void
+bpin(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt++;
+  release(&bk->lock);
+}
 
-  acquire(&bcache.lock);
+// Undo a bpin(), leaving b to be recycled once it is released.
+void
+bunpin(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  if(b->refcnt == 0)
+    b->used = 1;
+  release(&bk->lock);
 }
 //PAGEBREAK!
 // Blank page.
-
@@ -4,11 +4,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int used;         // referenced since the clock hand last passed
+  struct buf *prev; // hash bucket list
   struct buf *next;
+  struct buf *cnext; // ring of all buffers, for recycling
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uint qbypass;      // times passed over in disk queue
+  uchar *data;       // BSIZE bytes
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // release buffer when disk request completes
 
@@ -9,6 +9,14 @@ cat(int fd)
 {
   int n;
 
+  // The kernel moves the bytes; they need not pass through here.
+  while((n = sendfile(1, fd, 4096)) > 0)
+    ;
+  if(n == 0)
+    return;
+
+  // sendfile() does not say which side failed, so carry on with
+  // read() and write(), which do.
   while((n = read(fd, buf, sizeof(buf))) > 0) {
     if (write(1, buf, n) != n) {
       printf(1, "cat: write error\n");
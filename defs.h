@@ -2,8 +2,10 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iostat;
 struct pipe;
 struct proc;
+struct rawin;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
@@ -13,7 +15,12 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bnew(uint, uint);
+void            breadahead(uint, uint*, int);
 void            brelse(struct buf*);
+void            biodone(struct buf*);
+void            bpin(struct buf*);
+void            bunpin(struct buf*);
 void            bwrite(struct buf*);
 
 // console.c
@@ -31,18 +38,23 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
+int             filesend(struct file*, struct file*, int);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
 int             dirlink(struct inode*, char*, uint);
+void            dirunlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            iflush(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
+char*           ipage(struct inode*, uint);
 void            iput(struct inode*);
+int             istage(struct inode*, char*, uint, uint);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
@@ -50,6 +62,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            readahead(struct inode*, struct rawin*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
@@ -57,6 +70,8 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
+void            idestat(struct iostat*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -65,7 +80,10 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+void            kdup(char*);
 void            kfree(char*);
+int             kfreecount(void);
+int             krefcnt(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -87,6 +105,15 @@ void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
 
+// mmap.c
+int             mmap(struct file*, uint, uint, int, int);
+int             mmapfault(uint);
+int             mmapped(struct proc*, uint, uint);
+uint            mmapbase(struct proc*);
+int             mmapdup(struct proc*, struct proc*);
+int             munmap(uint, uint);
+void            munmapall(struct proc*);
+
 // mp.c
 extern int      ismp;
 void            mpinit(void);
@@ -98,6 +125,10 @@ void            picinit(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
+int             pipegetr(struct pipe*, char**, int);
+int             pipegetw(struct pipe*, char**, int);
+void            pipeputr(struct pipe*, int);
+void            pipeputw(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
@@ -111,9 +142,12 @@ int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
+int             preempt(void);
+void            prioboost(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             setpriority(int, int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
@@ -151,6 +185,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argout(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -181,10 +216,18 @@ void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
+int             shareuvm(pde_t*, pde_t*, uint, uint, int);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+int             cowfault(pde_t*, uint);
+int             pgfault(uint, uint);
+int             touchuvm(uint, uint, int);
+char*           unmapuvm(pde_t*, uint, int*);
+char*           uvmshare(pde_t*, uint);
+char*           uvmswap(pde_t*, uint, char*);
+int             mappages(pde_t*, void*, uint, uint, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
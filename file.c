@@ -5,6 +5,7 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
@@ -74,6 +75,11 @@ fileclose(struct file *f)
     pipeclose(ff.pipe, ff.writable);
   else if(ff.type == FD_INODE){
     begin_op();
+    if(ff.writable){
+      ilock(ff.ip);
+      iflush(ff.ip);
+      iunlock(ff.ip);
+    }
     iput(ff.ip);
     end_op();
   }
@@ -104,14 +110,68 @@ fileread(struct file *f, char *addr, int n)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, addr, f->off, n)) > 0){
+      readahead(f->ip, &f->ra, f->off, r);
       f->off += r;
+    }
     iunlock(f->ip);
     return r;
   }
   panic("fileread");
 }
 
+// Move up to n bytes from file in to file out without copying
+// them through user memory, and return how many were moved, 0 at
+// end of file, or -1.  To or from a pipe, the bytes are copied
+// straight into or out of the pipe's buffer, and at most one
+// buffer's worth moves at a time; between other files they go
+// through a kernel page.
+int
+filesend(struct file *out, struct file *in, int n)
+{
+  char *a, *page;
+  int tot, m, r;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_PIPE && out->type == FD_PIPE && in->pipe == out->pipe)
+    return -1;
+
+  page = 0;
+  r = 0;
+  tot = 0;
+  while(tot < n){
+    if(out->type == FD_PIPE){
+      if((m = pipegetw(out->pipe, &a, n - tot)) < 0)
+        r = -1;
+      else {
+        r = fileread(in, a, m);
+        pipeputw(out->pipe, r > 0 ? r : 0);
+      }
+    } else if(in->type == FD_PIPE){
+      if((r = m = pipegetr(in->pipe, &a, n - tot)) > 0){
+        r = filewrite(out, a, m);
+        pipeputr(in->pipe, r > 0 ? r : 0);
+      }
+    } else {
+      if(page == 0 && (page = kalloc()) == 0)
+        return tot > 0 ? tot : -1;
+      m = n - tot < PGSIZE ? n - tot : PGSIZE;
+      if((r = fileread(in, page, m)) > 0 && filewrite(out, page, r) != r)
+        r = -1;
+    }
+    if(r <= 0)
+      break;
+    tot += r;
+    // A pipe may have no more for a while; return what we have.
+    if(in->type == FD_PIPE || r < m)
+      break;
+  }
+  if(page)
+    kfree(page);
+  return tot > 0 ? tot : r;
+}
+
 //PAGEBREAK!
 // Write to file f.
 int
@@ -130,8 +190,18 @@ filewrite(struct file *f, char *addr, int n)
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((LOGSIZE-1-1-2) / 2) * 512;
+    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
     int i = 0;
+
+    // Small appends are staged in memory and written out
+    // later, many at a time; see istage().
+    ilock(f->ip);
+    if((r = istage(f->ip, addr, f->off, n)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    if(r == n)
+      return n;
+
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
@@ -139,6 +209,13 @@ filewrite(struct file *f, char *addr, int n)
 
       begin_op();
       ilock(f->ip);
+      if(f->ip->wlen > 0){
+        // Write out staged bytes first, in their own transaction.
+        iflush(f->ip);
+        iunlock(f->ip);
+        end_op();
+        continue;
+      }
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
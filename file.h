@@ -1,3 +1,9 @@
+// A sequential reader's read-ahead window; see readahead().
+struct rawin {
+  uint next;  // where a sequential read would start
+  uint end;   // first block not yet read ahead
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE } type;
   int ref; // reference count
@@ -6,6 +12,7 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  struct rawin ra;  // read-ahead window, per open file
 };
 
 
@@ -14,6 +21,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int used;           // released since the clock hand last passed
+  struct inode *prev; // hash bucket list
+  struct inode *next;
+  struct inode *cnext; // clock ring
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -22,7 +33,12 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint indirect;
+  uint dindirect;
+
+  char *wbuf;         // bytes appended after size, not yet written
+  uint wlen;
 };
 
 // table mapping major device number to
@@ -23,6 +23,9 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void dcinit(void);
+static void dcpurge(uint, uint);
+static void isuminit(int);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -44,39 +47,145 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  bp = bnew(dev, bno);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// The bitmap is summarized in memory by the number of free
+// blocks each bitmap block describes, so that balloc() skips
+// full bitmap blocks without reading them.  A bitmap block's
+// count changes only while its buffer is locked; reads of it
+// without the lock are just hints.  Allocations without a goal
+// continue after the previous one (next fit) rather than
+// searching from the start of the disk every time.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+#define MAXBMAP 64  // max bitmap blocks
+
+static struct {
+  uint nfree[MAXBMAP];  // free blocks per bitmap block
+  uint next;            // where to look when there is no goal
+} bsum;
+
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, bi;
 
-  bp = 0;
+  if((sb.size + BPB - 1) / BPB > MAXBMAP)
+    panic("bsuminit: bitmap too large");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+    bsum.nfree[b/BPB] = 0;
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi%8))) == 0)
+        bsum.nfree[b/BPB]++;
+    brelse(bp);
+  }
+  bsum.next = 0;
+}
+
+// Return the length of the run of free blocks at bit bi of
+// bitmap block data, at most n and not reaching bit lim.
+static int
+brun(uchar *data, int bi, int lim, int n)
+{
+  int k;
+
+  for(k = 0; k < n && bi + k < lim; k++)
+    if(data[(bi+k)/8] & (1 << ((bi+k)%8)))
+      break;
+  return k;
+}
+
+// Return the first bit from lo up to hi of bitmap block data
+// that starts a run of at least need free blocks, or -1, and
+// set *len to the run's length, at most n.
+static int
+bfind(uchar *data, int lo, int hi, int lim, int need, int n, int *len)
+{
+  int bi, k;
+
+  for(bi = lo; bi < hi; bi++){
+    if(bi%8 == 0 && data[bi/8] == 0xff){  // skip 8 used blocks
+      bi += 7;
+      continue;
+    }
+    if((k = brun(data, bi, lim, n)) >= need){
+      *len = k;
+      return bi;
+    }
+    bi += k;
+  }
+  return -1;
+}
+
+// Allocate a run of up to n zeroed disk blocks and return the
+// first, setting *got to the run's length.  The run starts at
+// goal if goal is free, else at the first block after it,
+// wrapping around, that starts a run of n free blocks, or
+// failing that at the first free block.  Runs do not cross
+// bitmap blocks.
+static uint
+ballocrun(uint dev, uint goal, uint n, uint *got)
+{
+  struct buf *bp;
+  uint b, bb, i, nbmap, lim, pass, need;
+  int bi, len;
+
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.next;
+  nbmap = (sb.size + BPB - 1) / BPB;
+  for(pass = 0; pass < 2; pass++){
+    need = pass == 0 ? n : 1;
+    // Visit goal's bitmap block from goal on, then the others,
+    // then goal's again up to goal.
+    for(i = 0; i <= nbmap; i++){
+      bb = (goal/BPB + i) % nbmap;
+      if(bsum.nfree[bb] < need)
+        continue;
+      lim = min(BPB, sb.size - bb*BPB);
+      bp = bread(dev, sb.bmapstart + bb);
+      bi = -1;
+      if(i == 0 && pass == 0 && (len = brun(bp->data, goal%BPB, lim, n)) > 0)
+        bi = goal%BPB;
+      if(bi < 0)
+        bi = bfind(bp->data, i == 0 ? goal%BPB : 0,
+                   i == nbmap ? goal%BPB : lim, lim, need, n, &len);
+      if(bi >= 0){
+        for(b = bi; b < bi + len; b++)
+          bp->data[b/8] |= 1 << (b%8);  // Mark blocks in use.
+        bsum.nfree[bb] -= len;
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        b = bb*BPB + bi;
+        for(i = 0; i < len; i++)
+          bzero(dev, b + i);
+        bsum.next = b + len;
+        *got = len;
+        return b;
       }
+      brelse(bp);
     }
-    brelse(bp);
+    if(n == 1)
+      break;
   }
   panic("balloc: out of blocks");
 }
 
+// Allocate a zeroed disk block: goal if it is free, else
+// the first free block after it, wrapping around.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint n;
+
+  return ballocrun(dev, goal, 1, &n);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -84,13 +193,13 @@ bfree(int dev, uint b)
   struct buf *bp;
   int bi, m;
 
-  readsb(dev, &sb);
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  bsum.nfree[b/BPB]++;
   log_write(bp);
   brelse(bp);
 }
@@ -121,7 +230,8 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   is unused if ip->ref is zero, and may then be recycled
+//   for another i-node. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
@@ -131,7 +241,8 @@ bfree(int dev, uint b)
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode, and iget() when
+//   it recycles the entry.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -155,39 +266,174 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The inode cache is a hash table of inode entries.  Each hash
+// bucket has a spin-lock that protects the ref, dev, and inum
+// fields of the entries in it; since ip->ref indicates whether an
+// entry is in use, and ip->dev and ip->inum indicate which i-node
+// an entry holds, one must hold the bucket's lock while using any
+// of those fields.  Entries stay in the cache, still valid, after
+// their last reference is dropped, and iget() reuses the one the
+// clock sweep finds least recently used.  icache.lock serializes
+// misses, so an i-node cannot be given two entries.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// The entries are allocated with kalloc() when the file system
+// is mounted; iinit() sizes the cache from the free memory, up
+// to NINODE.
 
-struct {
+#define NIBUCKET 127
+#define ICACHEFRAC 64  // use at most 1/ICACHEFRAC of free memory
+#define MININODE NFILE
+
+struct ibucket {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode head;  // list of entries through prev/next
+};
+
+struct {
+  struct spinlock lock;  // serializes misses
+  int ninode;
+  struct inode *hand;    // clock hand, on the ring through cnext
+  struct ibucket bucket[NIBUCKET];
 } icache;
 
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  return &icache.bucket[(dev*31 + inum) % NIBUCKET];
+}
+
+static void
+iunlink(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+static void
+ilink(struct ibucket *bk, struct inode *ip)
+{
+  ip->next = bk->head.next;
+  ip->prev = &bk->head;
+  bk->head.next->prev = ip;
+  bk->head.next = ip;
+}
+
 void
 iinit(int dev)
 {
-  int i = 0;
-  
+  struct inode *ip, *ips, *last;
+  struct ibucket *bk;
+  int i, n;
+
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  for(bk = icache.bucket; bk < icache.bucket+NIBUCKET; bk++){
+    initlock(&bk->lock, "icache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
   }
 
+  icache.ninode = kfreecount() / ICACHEFRAC * (PGSIZE/sizeof(struct inode));
+  if(icache.ninode > NINODE)
+    icache.ninode = NINODE;
+  if(icache.ninode < MININODE)
+    panic("iinit: no memory");
+
+  // Carve entries out of whole pages and link them into a ring
+  // for the clock sweep.  All entries start out as i-node 0 of
+  // device 0, which is never used.
+  bk = ihash(0, 0);
+  last = 0;
+  n = 0;
+  ips = 0;
+  for(i = 0; i < icache.ninode; i++){
+    if(n == 0){
+      if((ips = (struct inode*)kalloc()) == 0)
+        panic("iinit: kalloc");
+      memset(ips, 0, PGSIZE);
+      n = PGSIZE / sizeof(struct inode);
+    }
+    ip = ips++;
+    n--;
+    initsleeplock(&ip->lock, "inode");
+    ilink(bk, ip);
+    if(last)
+      last->cnext = ip;
+    else
+      icache.hand = ip;
+    last = ip;
+  }
+  last->cnext = icache.hand;
+
+  dcinit();
+
   readsb(dev, &sb);
+  if(sb.bsize != BSIZE)
+    panic("iinit: file system block size");
+  bsuminit(dev);
+  isuminit(dev);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
+ inodestart %d bmap start %d bsize %d\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+          sb.bmapstart, sb.bsize);
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Free inodes.  iinit() reads the inode blocks once to build
+// a bitmap of the inodes in use, so that ialloc() can find a
+// free one without reading the disk.  isum.next is the lowest
+// inode that might be free.
+
+#define MAXINODE 8192
+
+static struct {
+  struct spinlock lock;
+  uint used[MAXINODE/32];
+  uint next;
+} isum;
+
+static void
+isuminit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum;
+
+  if(sb.ninodes > MAXINODE)
+    panic("isuminit: too many inodes");
+  initlock(&isum.lock, "isum");
+  isum.used[0] = 1;  // inode 0 is never used
+  bp = 0;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    if(bp == 0 || bp->blockno != IBLOCK(inum, sb)){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type != 0)
+      isum.used[inum/32] |= 1U << (inum%32);
+  }
+  if(bp)
+    brelse(bp);
+  isum.next = 1;
+}
+
+// Note that inode inum is free on disk.
+static void
+ifree(uint inum)
+{
+  acquire(&isum.lock);
+  isum.used[inum/32] &= ~(1U << (inum%32));
+  if(inum < isum.next)
+    isum.next = inum;
+  release(&isum.lock);
+}
+
 //PAGEBREAK!
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -195,23 +441,34 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  acquire(&isum.lock);
+  for(inum = isum.next; inum < sb.ninodes; inum++){
+    if(inum%32 == 0 && isum.used[inum/32] == ~0){  // skip 32 used inodes
+      inum += 31;
+      continue;
     }
-    brelse(bp);
+    if((isum.used[inum/32] & (1U << (inum%32))) == 0)
+      break;
   }
-  panic("ialloc: no inodes");
+  if(inum >= sb.ninodes)
+    panic("ialloc: no inodes");
+  isum.used[inum/32] |= 1U << (inum%32);
+  isum.next = inum + 1;
+  release(&isum.lock);
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -231,44 +488,90 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->indirect = ip->indirect;
+  dip->dindirect = ip->dindirect;
   log_write(bp);
   brelse(bp);
 }
 
+// Look for inode inum on device dev in bucket bk, which must be locked.
+static struct inode*
+ilookup(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head.next; ip != &bk->head; ip = ip->next)
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  return 0;
+}
+
+// Find an unused entry with the clock algorithm, skipping (and
+// clearing) recently used ones, and remove it from its bucket.
+// Caller must hold icache.lock, which keeps the entries' identities
+// and so their buckets stable.
+static struct inode*
+irecycle(void)
+{
+  struct inode *ip;
+  struct ibucket *bk;
+  int n;
+
+  for(n = 0; n < 2*icache.ninode; n++){
+    ip = icache.hand;
+    icache.hand = ip->cnext;
+    bk = ihash(ip->dev, ip->inum);
+    acquire(&bk->lock);
+    if(ip->ref == 0){
+      if(ip->used)
+        ip->used = 0;
+      else {
+        ip->ref = 1;
+        iunlink(ip);
+        release(&bk->lock);
+        return ip;
+      }
+    }
+    release(&bk->lock);
+  }
+  panic("iget: no inodes");
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
-
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  struct inode *ip;
+  struct ibucket *bk;
+
+  bk = ihash(dev, inum);
+  acquire(&bk->lock);
+  if((ip = ilookup(bk, dev, inum)) != 0)
+    ip->ref++;
+  release(&bk->lock);
+  if(ip == 0){
+    // Not cached; recycle an unused entry.  Look again once
+    // misses are serialized, in case another process just
+    // cached the inode.
+    acquire(&icache.lock);
+    acquire(&bk->lock);
+    if((ip = ilookup(bk, dev, inum)) != 0)
       ip->ref++;
-      release(&icache.lock);
-      return ip;
+    release(&bk->lock);
+    if(ip == 0){
+      ip = irecycle();
+      ip->dev = dev;
+      ip->inum = inum;
+      ip->valid = 0;
+      acquire(&bk->lock);
+      ilink(bk, ip);
+      release(&bk->lock);
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    release(&icache.lock);
   }
-
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
-  release(&icache.lock);
-
   return ip;
 }
 
@@ -277,9 +580,12 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk;
+
+  bk = ihash(ip->dev, ip->inum);
+  acquire(&bk->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -304,7 +610,9 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->indirect = dip->indirect;
+    ip->dindirect = dip->dindirect;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -332,24 +640,33 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct ibucket *bk;
+
+  bk = ihash(ip->dev, ip->inum);
   acquiresleep(&ip->lock);
   if(ip->valid && ip->nlink == 0){
-    acquire(&icache.lock);
+    acquire(&bk->lock);
     int r = ip->ref;
-    release(&icache.lock);
+    release(&bk->lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcpurge(ip->dev, ip->inum);
+      iflush(ip);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      ifree(ip->inum);
     }
   }
   releasesleep(&ip->lock);
 
-  acquire(&icache.lock);
+  acquire(&bk->lock);
   ip->ref--;
-  release(&icache.lock);
+  if(ip->ref == 0)
+    ip->used = 1;
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -364,42 +681,127 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk.  The first blocks are described by
+// up to NEXTENT extents in ip->ext[], runs of consecutive
+// blocks, so that mapping them needs no disk reads.  The next
+// NINDIRECT blocks are listed in block ip->indirect, and the
+// rest in the blocks listed in block ip->dindirect.
+// A file's blocks are allocated in order, each as close after
+// the previous one as possible, and the last extent grows
+// while they are contiguous.  Once the indirect block is in
+// use the extents are sealed, since its numbering starts
+// where they end.
+
+// Return the bn'th block number listed in indirect block ind.
+// If there is none, list addr there, or a new block if addr is 0.
+static uint
+bmapind(uint dev, uint ind, uint bn, uint addr)
+{
+  uint *a, goal;
+  struct buf *bp;
+
+  bp = bread(dev, ind);
+  a = (uint*)bp->data;
+  if(a[bn] == 0){
+    if(addr == 0){
+      goal = bn > 0 ? a[bn-1] + 1 : ind + 1;
+      addr = balloc(dev, goal);
+    }
+    a[bn] = addr;
+    log_write(bp);
+  }
+  addr = a[bn];
+  brelse(bp);
+  return addr;
+}
+
+// Allocate up to n blocks to follow the ones ip's extents map,
+// e being the first unused extent, and add them to the extents.
+// Return the first new block; if the extents are full and it
+// does not continue the last one, it is not added.
+static uint
+iextend(struct inode *ip, struct extent *e, uint n)
+{
+  uint addr, goal;
+
+  if(e == ip->ext+NEXTENT)
+    n = 1;
+  goal = e > ip->ext ? e[-1].start + e[-1].len : 0;
+  addr = ballocrun(ip->dev, goal, n, &n);
+  if(e > ip->ext && addr == goal)
+    e[-1].len += n;
+  else if(e < ip->ext+NEXTENT){
+    e->start = addr;
+    e->len = n;
+  }
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr, ind;
+  struct extent *e;
+
+  for(e = ip->ext; e < ip->ext+NEXTENT && e->len > 0; e++){
+    if(bn < e->len)
+      return e->start + bn;
+    bn -= e->len;
+  }
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  addr = 0;
+  if(bn == 0 && ip->indirect == 0){
+    // Appending just past the extents: grow the last one if
+    // the next disk block is free, or start another.
+    addr = iextend(ip, e, 1);
+    if(e < ip->ext+NEXTENT || addr == e[-1].start + e[-1].len - 1)
+      return addr;
+    // Out of extents; addr goes in the indirect block.
   }
-  bn -= NDIRECT;
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+    if(ip->indirect == 0)
+      ip->indirect = balloc(ip->dev, addr);
+    return bmapind(ip->dev, ip->indirect, bn, addr);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NINDIRECT*NINDIRECT){
+    if(ip->dindirect == 0)
+      ip->dindirect = balloc(ip->dev, 0);
+    ind = bmapind(ip->dev, ip->dindirect, bn / NINDIRECT, 0);
+    return bmapind(ip->dev, ind, bn % NINDIRECT, 0);
   }
 
   panic("bmap: out of range");
 }
 
+// Free indirect block ind and the blocks it lists, which are
+// themselves indirect blocks if depth > 0.
+static void
+freeind(uint dev, uint ind, int depth)
+{
+  int j;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(dev, ind);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 0)
+      freeind(dev, a[j], depth - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, ind);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -408,33 +810,49 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
-
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  struct extent *e;
+  uint b;
+
+  for(e = ip->ext; e < ip->ext+NEXTENT; e++){
+    for(b = 0; b < e->len; b++)
+      bfree(ip->dev, e->start + b);
+    e->start = 0;
+    e->len = 0;
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  if(ip->indirect){
+    freeind(ip->dev, ip->indirect, 0);
+    ip->indirect = 0;
+  }
+  if(ip->dindirect){
+    freeind(ip->dev, ip->dindirect, 1);
+    ip->dindirect = 0;
   }
 
   ip->size = 0;
   iupdate(ip);
 }
 
+// Number of disk blocks ip uses, counting indirect blocks.
+static uint
+iblocks(struct inode *ip)
+{
+  uint n, nb;
+  struct extent *e;
+
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  n = nb;
+  for(e = ip->ext; e < ip->ext+NEXTENT; e++)
+    nb = nb > e->len ? nb - e->len : 0;
+  if(ip->indirect){
+    n++;
+    nb = nb > NINDIRECT ? nb - NINDIRECT : 0;
+  }
+  if(ip->dindirect)
+    n += 1 + (nb + NINDIRECT - 1) / NINDIRECT;
+  return n;
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -444,7 +862,43 @@ stati(struct inode *ip, struct stat *st)
   st->ino = ip->inum;
   st->type = ip->type;
   st->nlink = ip->nlink;
-  st->size = ip->size;
+  st->size = ip->size + ip->wlen;
+  st->blocks = iblocks(ip);
+}
+
+// Sequential read-ahead, for a reader of ip that keeps its
+// window in *ra, such as an open file.  If a read of n bytes at
+// off started where the reader's previous one ended, start
+// asynchronous reads of the NREADAHEAD blocks after it, so the
+// disk works while the reader copies.  The window is topped up
+// only once half of it has been consumed, to keep requests
+// large.  Caller must hold ip->lock.
+#define NREADAHEAD 16
+
+void
+readahead(struct inode *ip, struct rawin *ra, uint off, uint n)
+{
+  uint bn, last, end, nblocks, blocks[NREADAHEAD];
+  int nb;
+
+  if(n == 0 || ip->type != T_FILE)
+    return;
+  if(off != ra->next){
+    ra->next = off + n;
+    ra->end = 0;
+    return;
+  }
+  ra->next = off + n;
+  last = (off + n - 1) / BSIZE;
+  if(ra->end > last + NREADAHEAD/2)
+    return;
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(last + 1 + NREADAHEAD, nblocks);
+  bn = ra->end > last ? ra->end : last + 1;
+  for(nb = 0; bn < end; bn++)
+    blocks[nb++] = bmap(ip, bn);
+  breadahead(ip->dev, blocks, nb);
+  ra->end = end;
 }
 
 //PAGEBREAK!
@@ -462,27 +916,49 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return devsw[ip->major].read(ip, dst, n);
   }
 
-  if(off > ip->size || off + n < off)
+  if(off > ip->size + ip->wlen || off + n < off)
     return -1;
-  if(off + n > ip->size)
-    n = ip->size - off;
+  if(off + n > ip->size + ip->wlen)
+    n = ip->size + ip->wlen - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+  for(tot=0; tot<n && off<ip->size; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
+    m = min(min(n - tot, BSIZE - off%BSIZE), ip->size - off);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
+  if(tot < n)  // the rest is staged
+    memmove(dst, ip->wbuf + off - ip->size, n - tot);
   return n;
 }
 
+// Return the data page of the cached block holding byte off of
+// ip, with a reference added that the caller drops with kfree().
+// The block size must be the page size, and off below ip->size.
+// Caller must hold ip->lock.
+char*
+ipage(struct inode *ip, uint off)
+{
+  struct buf *bp;
+  char *page;
+
+  if(BSIZE != PGSIZE || off >= ip->size)
+    panic("ipage");
+  bp = bread(ip->dev, bmap(ip, off/BSIZE));
+  page = (char*)bp->data;
+  kdup(page);
+  brelse(bp);
+  return page;
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, bn, nb;
+  struct extent *e;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -493,9 +969,19 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if((off + n + BSIZE - 1) / BSIZE > MAXFILE)
     return -1;
 
+  // Allocate the blocks this write appends as one run if the
+  // extents can take them, so they are contiguous on disk.
+  nb = (off + n + BSIZE - 1) / BSIZE;
+  bn = 0;
+  for(e = ip->ext; e < ip->ext+NEXTENT && e->len > 0; e++)
+    bn += e->len;
+  if(nb > bn + 1 && ip->indirect == 0 && e < ip->ext+NEXTENT &&
+     bn == (ip->size + BSIZE - 1) / BSIZE)
+    iextend(ip, e, nb - bn);
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -511,6 +997,51 @@ writei(struct inode *ip, char *src, uint off, uint n)
   return n;
 }
 
+// Delayed writes.  Small appends to a regular file are staged
+// in a page of memory instead of being written through the log
+// one write() at a time; the staged bytes follow ip->size, which
+// only covers what is on disk.  iflush() writes them all in one
+// transaction, so their blocks are allocated together and each
+// block is logged once.  The file layer flushes before any write
+// that is not staged and when the file is closed; a crash loses
+// what is still staged.
+#define STAGESIZE min(PGSIZE, ((MAXOPBLOCKS-1-1-2)/2)*BSIZE)
+
+// Stage the n bytes at src to be written at off, if they are a
+// small append to a regular file and there is room.  Return n
+// if so, or 0.  Caller must hold ip->lock.
+int
+istage(struct inode *ip, char *src, uint off, uint n)
+{
+  if(ip->type != T_FILE || n == 0 || n >= BSIZE)
+    return 0;
+  if(off != ip->size + ip->wlen || ip->wlen + n > STAGESIZE)
+    return 0;
+  if((off + n + BSIZE - 1) / BSIZE > MAXFILE)
+    return 0;
+  if(ip->wbuf == 0 && (ip->wbuf = kalloc()) == 0)
+    return 0;
+  memmove(ip->wbuf + ip->wlen, src, n);
+  ip->wlen += n;
+  return n;
+}
+
+// Write out the bytes staged for ip, or drop them if ip has
+// been unlinked.  Caller must hold ip->lock and, unless
+// ip->nlink is 0, be inside a transaction.
+void
+iflush(struct inode *ip)
+{
+  if(ip->wbuf == 0)
+    return;
+  if(ip->nlink > 0 && ip->wlen > 0)
+    if(writei(ip, ip->wbuf, ip->size, ip->wlen) != ip->wlen)
+      panic("iflush");
+  kfree(ip->wbuf);
+  ip->wbuf = 0;
+  ip->wlen = 0;
+}
+
 //PAGEBREAK!
 // Directories
 
@@ -520,41 +1051,236 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory name cache.
+//
+// Remembers the results of dirlookup(): that name in directory
+// dir on dev is inode inum, whose entry is at offset off, or,
+// if inum is 0, that there is no such name.  The cache is
+// set-associative: a name hashes to a set of DCWAYS entries,
+// and replaces the least recently used one.  dirlink() and
+// dirunlink() keep it up to date, and iput() forgets a
+// directory's entries when the directory is freed.  Callers
+// hold the directory's lock, so the cache and the directory
+// change together.
+
+#define DCWAYS 4
+#define DCSETS 256
+
+struct dcentry {
+  uint dev;
+  uint dir;           // 0 if entry is unused
+  uint inum;          // 0 if name is not in dir
+  uint off;
+  uint stamp;         // for LRU replacement
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock[DCSETS];
+  struct dcentry set[DCSETS][DCWAYS];
+  uint clock[DCSETS];  // stamps each set's entries, under its lock
+} dcache;
+
+static void
+dcinit(void)
+{
+  int i;
+
+  for(i = 0; i < DCSETS; i++)
+    initlock(&dcache.lock[i], "dcache");
+}
+
+static uint
+dchash(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev*31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % DCSETS;
+}
+
+// Look for name in directory dp in the cache.  If found,
+// set *pinum and *poff and return 1.
+static int
+dclookup(struct inode *dp, char *name, uint *pinum, uint *poff)
+{
+  struct dcentry *e;
+  uint h;
+
+  h = dchash(dp->dev, dp->inum, name);
+  acquire(&dcache.lock[h]);
+  for(e = dcache.set[h]; e < dcache.set[h]+DCWAYS; e++){
+    if(e->dir == dp->inum && e->dev == dp->dev && namecmp(e->name, name) == 0){
+      e->stamp = ++dcache.clock[h];
+      *pinum = e->inum;
+      *poff = e->off;
+      release(&dcache.lock[h]);
+      return 1;
+    }
+  }
+  release(&dcache.lock[h]);
+  return 0;
+}
+
+// Record that name in directory dp is inode inum at offset
+// off, or is not there if inum is 0.
+static void
+dcenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dcentry *e, *victim;
+  uint h;
+
+  h = dchash(dp->dev, dp->inum, name);
+  acquire(&dcache.lock[h]);
+  victim = dcache.set[h];
+  for(e = dcache.set[h]; e < dcache.set[h]+DCWAYS; e++){
+    if(e->dir == dp->inum && e->dev == dp->dev && namecmp(e->name, name) == 0){
+      victim = e;
+      break;
+    }
+    if(e->stamp < victim->stamp)
+      victim = e;
+  }
+  victim->dev = dp->dev;
+  victim->dir = dp->inum;
+  victim->inum = inum;
+  victim->off = off;
+  victim->stamp = ++dcache.clock[h];
+  strncpy(victim->name, name, DIRSIZ);
+  release(&dcache.lock[h]);
+}
+
+// Forget all names in directory dir on dev.
+static void
+dcpurge(uint dev, uint dir)
+{
+  struct dcentry *e;
+  int h;
+
+  for(h = 0; h < DCSETS; h++){
+    acquire(&dcache.lock[h]);
+    for(e = dcache.set[h]; e < dcache.set[h]+DCWAYS; e++)
+      if(e->dir == dir && e->dev == dev)
+        e->dir = 0;
+    release(&dcache.lock[h]);
+  }
+}
+
+// Search block lbn of directory dp for name, or for a free
+// slot if name is 0.  Return the slot's byte offset and set
+// *pinum to its inum, or return -1.  If lbn is a bucket block,
+// set *pnext to the next block in its chain.
+static int
+dirscan(struct inode *dp, uint lbn, char *name, uint *pinum, uint *pnext)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint i, first, n;
+  int off;
+
+  first = lbn == 0 ? 0 : 1;
+  n = DPB;
+  if(lbn == 0 && dp->size < BSIZE)
+    n = dp->size / sizeof(struct dirent);
+  if(n == 0)
+    return -1;
+
+  off = -1;
+  bp = bread(dp->dev, bmap(dp, lbn));
+  de = (struct dirent*)bp->data;
+  if(pnext)
+    *pnext = first ? ((struct dirmeta*)bp->data)->block[0] : 0;
+  for(i = first; i < n; i++){
+    if(name == 0 ? de[i].inum == 0 :
+       de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      off = lbn*BSIZE + i*sizeof(struct dirent);
+      if(pinum)
+        *pinum = de[i].inum;
+      break;
+    }
+  }
+  brelse(bp);
+  return off;
+}
+
+// Return the slot in the index of hashed directory dp that
+// holds the head of chain h.  Caller must brelse(*bpp).
+static uint*
+dirindex(struct inode *dp, uint h, struct buf **bpp)
+{
+  *bpp = bread(dp->dev, bmap(dp, 1));
+  return &((struct dirmeta*)(*bpp)->data)[h/3].block[h%3];
+}
+
+// Add a zeroed block to the end of directory dp.
+// Return its block number within dp.
+static uint
+dirgrow(struct inode *dp)
+{
+  uint lbn;
+
+  lbn = dp->size / BSIZE;
+  bmap(dp, lbn);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return lbn;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint inum, lbn, next;
+  int off;
+  struct buf *bp;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+  if(dclookup(dp, name, &inum, (uint*)&off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
   }
 
-  return 0;
+  off = dirscan(dp, 0, name, &inum, 0);
+  if(off < 0 && dp->size > BSIZE){
+    lbn = *dirindex(dp, dirhash(name), &bp);
+    brelse(bp);
+    for(; lbn != 0; lbn = next)
+      if((off = dirscan(dp, lbn, name, &inum, &next)) >= 0)
+        break;
+  }
+  if(off < 0){
+    dcenter(dp, name, 0, 0);
+    return 0;
+  }
+
+  // entry matches path element
+  if(poff)
+    *poff = off;
+  dcenter(dp, name, inum, off);
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Use a free slot in the first block, else one in the name's
+// hash chain, hashing the directory or growing the chain if
+// need be.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
+  uint h, head, lbn, next, *slot;
   struct dirent de;
   struct inode *ip;
+  struct buf *bp;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -562,22 +1288,53 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if((off = dirscan(dp, 0, 0, 0, 0)) < 0 && dp->size < BSIZE)
+    off = dp->size;
+  if(off < 0){
+    if(dp->size == BSIZE)
+      dirgrow(dp);  // the index
+    h = dirhash(name);
+    head = *dirindex(dp, h, &bp);
+    brelse(bp);
+    for(lbn = head; lbn != 0; lbn = next)
+      if((off = dirscan(dp, lbn, 0, 0, &next)) >= 0)
+        break;
+    if(off < 0){
+      // Chain is full; put a new block at its head.
+      lbn = dirgrow(dp);
+      bp = bread(dp->dev, bmap(dp, lbn));
+      ((struct dirmeta*)bp->data)->block[0] = head;
+      log_write(bp);
+      brelse(bp);
+      slot = dirindex(dp, h, &bp);
+      *slot = lbn;
+      log_write(bp);
+      brelse(bp);
+      off = lbn*BSIZE + sizeof(struct dirent);
+    }
   }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcenter(dp, name, inum, off);
 
   return 0;
 }
 
+// Remove the entry for name, at offset off, from directory dp.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink");
+  dcenter(dp, name, 0, 0);
+}
+
 //PAGEBREAK!
 // Paths
 
@@ -3,7 +3,12 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+// Block size: a multiple of the 512-byte disk sector, and at
+// most a page.  The kernel and mkfs must agree; it is recorded
+// in the super block.
+#ifndef BSIZE
+#define BSIZE 4096
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -19,11 +24,18 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (bytes)
 };
 
-#define NDIRECT 12
+#define NEXTENT 5
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NINDIRECT + NINDIRECT*NINDIRECT)  // at least
+
+// A run of len consecutive blocks starting at block start.
+struct extent {
+  uint start;
+  uint len;
+};
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +44,10 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // Runs of the first data blocks
+  uint indirect;        // Block listing the blocks after the runs
+  uint dindirect;       // Block listing blocks listing the rest
+  uint pad;
 };
 
 // Inodes per block.
@@ -55,3 +70,33 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Directory entries per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A directory that outgrows its first block is hashed.  The
+// first block is still searched linearly; block 1 is an index
+// of the heads of DIRNHASH chains of bucket blocks, and names
+// go in the chain picked by dirhash().  Slot 0 of each bucket
+// block links to the next block in its chain.  Slots that do not
+// hold entries have inum 0, so programs that read a directory
+// as an array of dirents skip them.
+struct dirmeta {
+  ushort inum;          // always 0
+  ushort pad;
+  uint block[3];        // chain heads, or next block in chain
+};
+
+#define DIRNHASH      (DPB*3)
+
+static inline uint
+dirhash(const char *name)
+{
+  uint h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % DIRNHASH;
+}
+
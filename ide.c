@@ -12,6 +12,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "iostat.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,16 +24,33 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMULT 0xc6
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+#define SPB           (BSIZE/SECTOR_SIZE)  // sectors per block
+#define IDE_MULT      16   // sectors per interrupt in RDMUL/WRMUL
+#define IDE_MAXSECT   128  // max sectors in one merged command
+#define IDE_MAXBYPASS 32   // max times a request can be passed over
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// idequeue points to the bufs waiting for the disk, linked
+// through qnext in C-SCAN order from idehead, the sector
+// after the last one the disk was asked for.  ideactive is the
+// chain of bufs for adjacent blocks that the command now in
+// flight reads or writes; idedone of its idensect sectors
+// have been transferred.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *ideactive;
+static int idensect;
+static int idedone;
+static uint idehead;
+static struct iostat idestats;
 
 static int havedisk1;
-static void idestart(struct buf*);
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,6 +65,17 @@ idewait(int checkerr)
   return 0;
 }
 
+// Ask disk d to transfer IDE_MULT sectors per interrupt
+// in RDMUL and WRMUL commands.
+static void
+idesetmult(int d)
+{
+  outb(0x1f2, IDE_MULT);
+  outb(0x1f6, 0xe0 | (d<<4));
+  outb(0x1f7, IDE_CMD_SETMULT);
+  idewait(0);
+}
+
 void
 ideinit(void)
 {
@@ -64,38 +93,81 @@ ideinit(void)
       break;
     }
   }
+  if(havedisk1)
+    idesetmult(1);
 
   // Switch back to disk 0.
-  outb(0x1f6, 0xe0 | (0<<4));
+  idesetmult(0);
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Move the next n sectors of the command in flight between
+// the disk and its bufs.  Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idexfer(int n)
 {
-  if(b == 0)
+  struct buf *b;
+  int k;
+
+  k = idedone;
+  for(b = ideactive; k >= SPB; b = b->qnext)
+    k -= SPB;
+  idedone += n;
+  for(; n > 0; n--){
+    if(b->flags & B_DIRTY)
+      outsl(0x1f0, b->data + k*SECTOR_SIZE, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, b->data + k*SECTOR_SIZE, SECTOR_SIZE/4);
+    if(++k == SPB){
+      k = 0;
+      b = b->qnext;
+    }
+  }
+}
+
+// Start a command for the buf at the head of idequeue and the
+// bufs queued right after it for the following blocks in the
+// same direction.  Caller must hold idelock.
+static void
+idestart(void)
+{
+  struct buf *b, *last;
+  int sector, write;
+
+  if((b = idequeue) == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
-  int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  write = b->flags & B_DIRTY;
+  idensect = SPB;
+  for(last = b; (b = last->qnext) != 0; last = b){
+    if(b->dev != last->dev || b->blockno != last->blockno+1 ||
+       (b->flags & B_DIRTY) != write || idensect+SPB > IDE_MAXSECT)
+      break;
+    idensect += SPB;
+  }
+  ideactive = idequeue;
+  idequeue = last->qnext;
+  last->qnext = 0;
+  idedone = 0;
 
-  if (sector_per_block > 7) panic("idestart");
+  b = ideactive;
+  if(last->blockno >= FSSIZE)
+    panic("incorrect blockno");
+  sector = b->blockno * SPB;
+  idestats.ncmd++;
+  idestats.seeksum += sector > idehead ? sector - idehead : idehead - sector;
+  idehead = sector + idensect;
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, idensect);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+  if(write){
+    outb(0x1f7, idensect == 1 ? IDE_CMD_WRITE : IDE_CMD_WRMUL);
+    idexfer(min(IDE_MULT, idensect));
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, idensect == 1 ? IDE_CMD_READ : IDE_CMD_RDMUL);
   }
 }
 
@@ -103,66 +175,150 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next;
+  int error;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if(ideactive == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  // The disk interrupts once per IDE_MULT sectors: when it has
+  // them ready for a read, or has taken them for a write.  A
+  // write is finished at the interrupt after the last sectors.
+  error = idewait(1) < 0;
+  if(!error && idedone < idensect){
+    idexfer(min(IDE_MULT, idensect - idedone));
+    if(idedone < idensect || (ideactive->flags & B_DIRTY)){
+      release(&idelock);
+      return;
+    }
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Command is finished.  Wake processes waiting for its
+  // bufs, or release the bufs nobody is waiting for.
+  for(b = ideactive; b; b = next){
+    next = b->qnext;
+    idestats.depth--;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC)
+      biodone(b);
+    else
+      wakeup(b);
+  }
+  ideactive = 0;
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
-    idestart(idequeue);
+    idestart();
 
   release(&idelock);
 }
 
+// Insert b into idequeue in C-SCAN order: ascending sector
+// from the disk head, then wrapping around to the lowest.
+// A request that newer ones have passed over IDE_MAXBYPASS
+// times is not passed again, which bounds how long any request
+// waits.  Caller must hold idelock.
+static void
+ideenqueue(struct buf *b)
+{
+  struct buf **pp, **at, *q;
+  uint key;
+
+  key = b->blockno*SPB - idehead;
+  at = 0;
+  for(pp=&idequeue; *pp; pp=&(*pp)->qnext){  //DOC:insert-queue
+    q = *pp;
+    if(q->qbypass >= IDE_MAXBYPASS){
+      if(at)
+        idestats.nstarve++;
+      at = 0;
+    } else if(at == 0 && key < q->blockno*SPB - idehead)
+      at = pp;
+  }
+  if(at == 0)
+    at = pp;
+
+  b->qbypass = 0;
+  b->qnext = *at;
+  *at = b;
+  for(q = b->qnext; q; q = q->qnext)
+    q->qbypass++;
+
+  idestats.nreq++;
+  idestats.depth++;
+  idestats.depthsum += idestats.depth;
+  if(idestats.depth > idestats.maxdepth)
+    idestats.maxdepth = idestats.depth;
+}
+
 //PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Sync bufs with disk.
+// For each buf: if B_DIRTY is set, write buf to disk, clear
+// B_DIRTY, set B_VALID.  Else if B_VALID is not set, read buf
+// from disk, set B_VALID.
+// The bufs are queued together, so requests for adjacent
+// blocks become one disk command.  Either all or none of the
+// bufs must be B_ASYNC.  If they are, return without waiting;
+// each buf is released with biodone() when it is done.
 void
-iderw(struct buf *b)
+iderwv(struct buf **bv, int n)
 {
-  struct buf **pp;
+  struct buf *b;
+  int i, async;
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+  if(n <= 0)
+    return;
+  async = bv[0]->flags & B_ASYNC;
+  for(i = 0; i < n; i++){
+    b = bv[i];
+    if(!holdingsleep(&b->lock))
+      panic("iderw: buf not locked");
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(b->dev != 0 && !havedisk1)
+      panic("iderw: ide disk 1 not present");
+    if((b->flags & B_ASYNC) != async)
+      panic("iderwv: mixed B_ASYNC");
+  }
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  for(i = 0; i < n; i++)
+    ideenqueue(bv[i]);
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(ideactive == 0)
+    idestart();
 
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+  // Wait for requests to finish, unless nobody will.
+  if(!async){
+    for(i = 0; i < n; i++){
+      b = bv[i];
+      while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+        sleep(b, &idelock);
+    }
   }
 
+  release(&idelock);
+}
+
+// Sync buf with disk.
+void
+iderw(struct buf *b)
+{
+  iderwv(&b, 1);
+}
 
+// Copy the disk statistics to st.
+void
+idestat(struct iostat *st)
+{
+  acquire(&idelock);
+  *st = idestats;
   release(&idelock);
 }
@@ -0,0 +1,55 @@
+// Print disk request statistics.  Given a command, run it
+// and print the statistics for just that run.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "iostat.h"
+
+static void
+report(struct iostat *a, struct iostat *b)
+{
+  uint nreq, ncmd;
+
+  nreq = b->nreq - a->nreq;
+  ncmd = b->ncmd - a->ncmd;
+  printf(1, "requests %d commands %d starved %d max depth %d\n",
+         nreq, ncmd, b->nstarve - a->nstarve, b->maxdepth);
+  if(nreq > 0)
+    printf(1, "avg depth %d\n", (b->depthsum - a->depthsum) / nreq);
+  if(ncmd > 0)
+    printf(1, "avg seek %d sectors, %d requests per command\n",
+           (b->seeksum - a->seeksum) / ncmd, nreq / ncmd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat zero, before, after;
+  int pid;
+
+  memset(&zero, 0, sizeof(zero));
+  if(iostat(&before) < 0){
+    printf(2, "iostat: failed\n");
+    exit();
+  }
+  if(argc < 2){
+    report(&zero, &before);
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(2, "iostat: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    exec(argv[1], argv+1);
+    printf(2, "iostat: exec %s failed\n", argv[1]);
+    exit();
+  }
+  wait();
+  iostat(&after);
+  report(&before, &after);
+  exit();
+}
@@ -0,0 +1,10 @@
+// Disk request statistics, returned by the iostat system call.
+struct iostat {
+  uint nreq;      // bufs submitted to the disk
+  uint ncmd;      // disk commands issued, after merging
+  uint depth;     // bufs now queued or in flight
+  uint maxdepth;  // largest depth seen
+  uint depthsum;  // sum of the depths seen by new requests
+  uint seeksum;   // total sectors moved between commands
+  uint nstarve;   // requests queued out of order to bound waiting
+};
@@ -1,6 +1,12 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// Each CPU keeps a private free list, so the common kalloc() and
+// kfree() touch only that CPU's (uncontended) lock.  A CPU whose
+// list runs dry refills it with a batch of pages from a shared
+// pool, or steals half of another CPU's list if the pool is empty;
+// a CPU whose list grows too long hands a batch back to the pool.
 
 #include "types.h"
 #include "defs.h"
@@ -9,6 +15,9 @@
 #include "mmu.h"
 #include "spinlock.h"
 
+#define KBATCH   32          // pages moved to or from the pool at once
+#define KCPUMAX  (4*KBATCH)  // max pages on a CPU's list before giving back
+
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
@@ -17,21 +26,45 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct freelist {
   struct spinlock lock;
+  struct run *head;
+  int n;             // number of pages on the list
+};
+
+struct {
   int use_lock;
-  struct run *freelist;
+  struct freelist pool;       // shared by all CPUs
+  struct freelist cpu[NCPU];  // per-CPU lists, indexed by cpuid()
 } kmem;
 
+// Reference counts for physical pages, indexed by physical page
+// number, so that copy-on-write fork can map one page into several
+// address spaces.  kalloc() sets a page's count to one; kdup() adds
+// a reference; kfree() frees the page when the last one is dropped.
+struct {
+  struct spinlock lock;
+  ushort count[PHYSTOP/PGSIZE];
+} pgref;
+
+#define PGNUM(v) (V2P(v) / PGSIZE)
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Until kinit2() finishes only one CPU is allocating, and all pages
+// live on the shared pool.
 void
 kinit1(void *vstart, void *vend)
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  initlock(&kmem.pool.lock, "kmem");
+  initlock(&pgref.lock, "pgref");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmemcpu");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -51,29 +84,115 @@ freerange(void *vstart, void *vend)
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
     kfree(p);
 }
+
+// Detach up to n pages from the front of fl and return them
+// as a chain, setting *last to the final page of the chain.
+// Caller must hold fl->lock.
+static struct run*
+takepages(struct freelist *fl, int n, struct run **last, int *got)
+{
+  struct run *chain, *r;
+  int i;
+
+  chain = r = fl->head;
+  for(i = 0; r && i < n; i++){
+    *last = r;
+    r = r->next;
+  }
+  if(i > 0)
+    (*last)->next = 0;
+  fl->head = r;
+  fl->n -= i;
+  *got = i;
+  return i > 0 ? chain : 0;
+}
+
+// Find a batch of free pages for CPU id, first from the shared
+// pool and then from the other CPUs.  Holds at most one lock at
+// a time, so two CPUs stealing from each other cannot deadlock.
+static struct run*
+refill(int id, struct run **last, int *got)
+{
+  struct freelist *fl;
+  struct run *chain;
+  int i;
+
+  acquire(&kmem.pool.lock);
+  chain = takepages(&kmem.pool, KBATCH, last, got);
+  release(&kmem.pool.lock);
+  if(chain)
+    return chain;
+
+  for(i = 0; i < NCPU; i++){
+    if(i == id)
+      continue;
+    fl = &kmem.cpu[i];
+    acquire(&fl->lock);
+    chain = takepages(fl, (fl->n + 1) / 2, last, got);
+    release(&fl->lock);
+    if(chain)
+      return chain;
+  }
+  return 0;
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// If the page is shared, just drop one reference.
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct freelist *fl;
+  struct run *r, *chain, *last;
+  int n;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  // Drop a reference to a shared page.  A count of one means the
+  // caller holds the only reference, so nobody else can change it.
+  if(pgref.count[PGNUM(v)] > 1){
+    acquire(&pgref.lock);
+    n = --pgref.count[PGNUM(v)];
+    release(&pgref.lock);
+    if(n > 0)
+      return;
+  }
+  pgref.count[PGNUM(v)] = 0;
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    r->next = kmem.pool.head;
+    kmem.pool.head = r;
+    kmem.pool.n++;
+    return;
+  }
+
+  pushcli();  // stay on this CPU while using its list
+  fl = &kmem.cpu[cpuid()];
+  acquire(&fl->lock);
+  r->next = fl->head;
+  fl->head = r;
+  fl->n++;
+  chain = 0;
+  if(fl->n > KCPUMAX)
+    chain = takepages(fl, KBATCH, &last, &n);
+  release(&fl->lock);
+
+  if(chain){
+    acquire(&kmem.pool.lock);
+    last->next = kmem.pool.head;
+    kmem.pool.head = chain;
+    kmem.pool.n += n;
+    release(&kmem.pool.lock);
+  }
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -82,15 +201,74 @@ kfree(char *v)
 char*
 kalloc(void)
 {
-  struct run *r;
+  struct freelist *fl;
+  struct run *r, *last;
+  int id, n;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
+  if(!kmem.use_lock){
+    r = kmem.pool.head;
+    if(r){
+      kmem.pool.head = r->next;
+      kmem.pool.n--;
+      pgref.count[PGNUM(r)] = 1;
+    }
+    return (char*)r;
+  }
+
+  pushcli();  // stay on this CPU while using its list
+  id = cpuid();
+  fl = &kmem.cpu[id];
+  acquire(&fl->lock);
+  r = fl->head;
+  if(r){
+    fl->head = r->next;
+    fl->n--;
+  }
+  release(&fl->lock);
+
+  if(r == 0 && (r = refill(id, &last, &n)) != 0){
+    // Keep the first page; the rest go on this CPU's list.
+    if(n > 1){
+      acquire(&fl->lock);
+      last->next = fl->head;
+      fl->head = r->next;
+      fl->n += n - 1;
+      release(&fl->lock);
+    }
+  }
+  popcli();
   if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+    pgref.count[PGNUM(r)] = 1;
   return (char*)r;
 }
 
+// Return the number of free pages.  The per-list counts are read
+// without locks, so the answer is only a snapshot.
+int
+kfreecount(void)
+{
+  int i, n;
+
+  n = kmem.pool.n;
+  for(i = 0; i < NCPU; i++)
+    n += kmem.cpu[i].n;
+  return n;
+}
+
+// Add a reference to the allocated page v.
+void
+kdup(char *v)
+{
+  acquire(&pgref.lock);
+  if(pgref.count[PGNUM(v)] < 1)
+    panic("kdup");
+  pgref.count[PGNUM(v)]++;
+  release(&pgref.lock);
+}
+
+// Return the number of references to the allocated page v.
+int
+krefcnt(char *v)
+{
+  return pgref.count[PGNUM(v)];
+}
@@ -10,8 +10,8 @@
 //
 // A log transaction contains the updates of multiple FS system
 // calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
+// no FS system calls active in the transaction. Thus there is
+// never any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
@@ -20,6 +20,15 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// Commits are double-buffered.  The committer first copies
+// the transaction's blocks from the cache into log buffers;
+// only during that copy must new system calls wait.  It then
+// starts the next transaction, and new system calls join that
+// one while the committer writes the copies to the log and
+// to their home locations.  The logged blocks stay pinned in
+// the cache until they are installed, and the next
+// transaction commits once the previous commit is done.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -27,7 +36,9 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous.  The log blocks are written
+// with one batch of disk requests, which the disk driver merges
+// into large commands, and the home locations with another.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -41,18 +52,25 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // a commit is in progress.
+  int copying;     // commit is copying blocks, please wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;    // transaction accepting system calls
+  struct logheader clh;   // transaction being committed
+  struct buf *cbuf[LOGSIZE];  // copies of clh's blocks
+  struct buf shadow[LOGSIZE]; // for installing the copies
+  struct buf *sv[LOGSIZE];    // shadow bufs by block number
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void commit(void);
 
 void
 initlog(int dev)
 {
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
@@ -62,35 +80,60 @@ initlog(int dev)
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  for (i = 0; i < LOGSIZE; i++)
+    initsleeplock(&log.shadow[i].lock, "logshadow");
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from the log to their home location.
+// When committing, the copies are in log.cbuf; they are
+// written home from private shadow bufs, in one batch sorted
+// by block number, so that the cached blocks, which the next
+// transaction may have changed, are left alone.
 static void
-install_trans(void)
+install_trans(struct logheader *lh, int recovering)
 {
-  int tail;
+  int tail, i;
+  struct buf *b;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  if(recovering){
+    for (tail = 0; tail < lh->n; tail++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
+      struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(lbuf);
+      brelse(dbuf);
+    }
+    return;
+  }
+
+  for (tail = 0; tail < lh->n; tail++) {
+    b = &log.shadow[tail];
+    acquiresleep(&b->lock);
+    b->dev = log.dev;
+    b->blockno = lh->block[tail];
+    b->data = log.cbuf[tail]->data;
+    b->flags = B_DIRTY;
+    for (i = tail; i > 0 && log.sv[i-1]->blockno > b->blockno; i--)
+      log.sv[i] = log.sv[i-1];
+    log.sv[i] = b;
   }
+  iderwv(log.sv, lh->n);
+  for (tail = 0; tail < lh->n; tail++)
+    releasesleep(&log.shadow[tail].lock);
 }
 
 // Read the log header from disk into the in-memory log header
 static void
-read_head(void)
+read_head(struct logheader *h)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  h->n = lh->n;
+  for (i = 0; i < h->n; i++) {
+    h->block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -99,14 +142,14 @@ read_head(void)
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *h)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = h->n;
+  for (i = 0; i < h->n; i++) {
+    hb->block[i] = h->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -115,10 +158,10 @@ write_head(void)
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  read_head(&log.clh);
+  install_trans(&log.clh, 1); // if committed, copy from log to disk
+  log.clh.n = 0;
+  write_head(&log.clh); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -127,7 +170,7 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.copying){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
@@ -141,7 +184,9 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless a commit is already in progress; that committer
+// will commit this transaction when it is done.
 void
 end_op(void)
 {
@@ -149,9 +194,9 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.copying)
+    panic("log.copying");
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -166,16 +211,14 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the modified blocks of the open transaction from the
+// cache into log buffers, and make it the committing one.
+// Caller has set log.copying, so no system call is active.
 static void
-write_log(void)
+copy_log(void)
 {
   int tail;
 
@@ -183,26 +226,74 @@ write_log(void)
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
     brelse(from);
-    brelse(to);
+    log.cbuf[tail] = to;
+    log.clh.block[tail] = log.lh.block[tail];
+  }
+  log.clh.n = log.lh.n;
+  log.lh.n = 0;
+}
+
+// Write the copies of the committing transaction to the log,
+// which is contiguous on disk, in one batch.
+static void
+write_log(void)
+{
+  int tail;
+
+  for (tail = 0; tail < log.clh.n; tail++)
+    log.cbuf[tail]->flags |= B_DIRTY;
+  iderwv(log.cbuf, log.clh.n);
+}
+
+// Release the committing transaction's log buffers and unpin
+// its blocks, which are now installed.
+static void
+release_log(void)
+{
+  int tail;
+  struct buf *b;
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    brelse(log.cbuf[tail]);
+    b = bread(log.dev, log.clh.block[tail]);
+    bunpin(b);
+    brelse(b);
   }
+  log.clh.n = 0;
 }
 
+// Commit the open transaction, and then any transaction
+// that completes while this one is being written.
+// Caller has set log.committing.
 static void
-commit()
+commit(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  acquire(&log.lock);
+  while(log.lh.n > 0 && log.outstanding == 0){
+    log.copying = 1;
+    release(&log.lock);
+    copy_log();      // Copy modified blocks from cache
+    acquire(&log.lock);
+    log.copying = 0;
+    wakeup(&log);    // the next transaction may start
+    release(&log.lock);
+
+    write_log();     // Write the copies to the log
+    write_head(&log.clh);  // Write header to disk -- the real commit
+    install_trans(&log.clh, 0); // Now install writes to home locations
+    release_log();
+    write_head(&log.clh);  // Erase the transaction from the log
+
+    acquire(&log.lock);
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
-// Record the block number and pin in the cache with B_DIRTY.
+// Record the block number and pin the buffer in the cache.
 // commit()/write_log() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
@@ -226,9 +317,9 @@ log_write(struct buf *b)
       break;
   }
   log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
+  if (i == log.lh.n) {  // Add new block to log, pinned until installed
+    bpin(b);
     log.lh.n++;
-  b->flags |= B_DIRTY; // prevent eviction
+  }
   release(&log.lock);
 }
-
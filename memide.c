@@ -12,17 +12,19 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "iostat.h"
 
-extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
+extern uchar _binary_memfs_img_start[], _binary_memfs_img_size[];
 
 static int disksize;
 static uchar *memdisk;
+static struct iostat idestats;
 
 void
 ideinit(void)
 {
-  memdisk = _binary_fs_img_start;
-  disksize = (uint)_binary_fs_img_size/BSIZE;
+  memdisk = _binary_memfs_img_start;
+  disksize = (uint)_binary_memfs_img_size/BSIZE;
 }
 
 // Interrupt handler.
@@ -35,6 +37,7 @@ ideintr(void)
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If B_ASYNC is set, release buf with biodone() when done.
 void
 iderw(struct buf *b)
 {
@@ -50,6 +53,8 @@ iderw(struct buf *b)
     panic("iderw: block out of range");
 
   p = memdisk + b->blockno*BSIZE;
+  idestats.nreq++;
+  idestats.ncmd++;
 
   if(b->flags & B_DIRTY){
     b->flags &= ~B_DIRTY;
@@ -57,4 +62,23 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if(b->flags & B_ASYNC)
+    biodone(b);
+}
+
+// Sync bufs with disk, as iderw() does one at a time.
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(bv[i]);
+}
+
+// Copy the disk statistics to st.
+void
+idestat(struct iostat *st)
+{
+  *st = idestats;
 }
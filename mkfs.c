@@ -39,6 +39,8 @@ void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
+uint fmap(struct dinode*, uint);
+void dappend(uint dino, char *name, uint inum);
 void iappend(uint inum, void *p, int n);
 
 // convert to intel byte order
@@ -69,7 +71,6 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   uint rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
   struct dinode din;
 
@@ -81,6 +82,7 @@ main(int argc, char *argv[])
     exit(1);
   }
 
+  assert((BSIZE % 512) == 0);
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
@@ -101,9 +103,10 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.bsize = xint(BSIZE);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d of %d bytes\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE, BSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -117,15 +120,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dappend(rootino, ".", rootino);
+  dappend(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -144,10 +140,7 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dappend(rootino, argv[i], inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -158,7 +151,7 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off + BSIZE - 1)/BSIZE) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -242,6 +235,7 @@ balloc(int used)
 
   printf("balloc: first %d blocks have been allocated\n", used);
   assert(used < BSIZE*8);
+  assert(used <= FSSIZE);
   bzero(buf, BSIZE);
   for(i = 0; i < used; i++){
     buf[i/8] = buf[i/8] | (0x1 << (i%8));
@@ -252,6 +246,44 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of the file din, which is
+// at most one past its last block.  Like bmap() in fs.c, grow
+// the extents while the file's blocks are contiguous, and then
+// list blocks in the indirect block.
+uint
+fmap(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+  struct extent *e;
+
+  for(e = din->ext; e < din->ext+NEXTENT && xint(e->len) > 0; e++){
+    if(fbn < xint(e->len))
+      return xint(e->start) + fbn;
+    fbn -= xint(e->len);
+  }
+  if(fbn == 0 && xint(din->indirect) == 0){
+    if(e > din->ext && xint(e[-1].start) + xint(e[-1].len) == freeblock){
+      e[-1].len = xint(xint(e[-1].len) + 1);
+      return freeblock++;
+    }
+    if(e < din->ext+NEXTENT){
+      e->start = xint(freeblock);
+      e->len = xint(1);
+      return freeblock++;
+    }
+  }
+  assert(fbn < NINDIRECT);
+  if(xint(din->indirect) == 0){
+    din->indirect = xint(freeblock++);
+  }
+  rsect(xint(din->indirect), (char*)indirect);
+  if(indirect[fbn] == 0){
+    indirect[fbn] = xint(freeblock++);
+    wsect(xint(din->indirect), (char*)indirect);
+  }
+  return xint(indirect[fbn]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +291,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -267,23 +298,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = fmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -295,3 +310,57 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Add an entry to directory dino, hashing the directory once it
+// outgrows its first block, as dirlink() in fs.c does.  Entries
+// are never removed here, so only the head block of a hash
+// chain can have a free slot.
+void
+dappend(uint dino, char *name, uint inum)
+{
+  struct dinode din;
+  struct dirent de, *bde;
+  struct dirmeta *m;
+  char index[BSIZE], buf[BSIZE];
+  uint h, head, size, i;
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+
+  rinode(dino, &din);
+  size = xint(din.size);
+  if(size < BSIZE){
+    iappend(dino, &de, sizeof(de));
+    return;
+  }
+  if(size == BSIZE){
+    iappend(dino, zeroes, BSIZE);  // the index
+    size += BSIZE;
+    rinode(dino, &din);
+  }
+
+  h = dirhash(name);
+  rsect(fmap(&din, 1), index);
+  m = (struct dirmeta*)index + h/3;
+  head = xint(m->block[h%3]);
+  if(head != 0){
+    rsect(fmap(&din, head), buf);
+    bde = (struct dirent*)buf;
+    for(i = 1; i < DPB; i++){
+      if(bde[i].inum == 0){
+        bde[i] = de;
+        wsect(fmap(&din, head), buf);
+        return;
+      }
+    }
+  }
+
+  // Start a new head block for the chain.
+  bzero(buf, BSIZE);
+  ((struct dirmeta*)buf)->block[0] = xint(head);
+  ((struct dirent*)buf)[1] = de;
+  iappend(dino, buf, BSIZE);
+  m->block[h%3] = xint(size / BSIZE);
+  wsect(fmap(&din, 1), index);
+}
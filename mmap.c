@@ -0,0 +1,279 @@
+// Memory-mapped files.
+//
+// mmap() reserves a range of user addresses just below the
+// lowest existing mapping, or KERNBASE, and records it in one of
+// the process's struct vmas; mmapfault() maps its pages as they
+// are touched.
+//
+// When blocks are page-sized, the buffer cache is also the page
+// cache: a mapped page is the data page of the block's buffer,
+// shared by reference count, so mapping a page copies nothing,
+// and processes that map a file, read() it or write() it all see
+// the same bytes.  A private writable mapping maps the page
+// copy-on-write.  If the buffer is recycled, bio.c gives it a new
+// page and the mappings keep the old one.  With smaller blocks,
+// each mapping gets its own copy of the file's pages.
+//
+// Pages of a shared mapping that were written are written back
+// through the log when they are unmapped, by munmap(), exec() or
+// exit().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "memlayout.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Return p's mapping that contains va, or 0.
+static struct vma*
+vmafind(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma+NVMA; v++)
+    if(v->f && va >= v->start && va < v->start + v->len)
+      return v;
+  return 0;
+}
+
+// Return the lowest address mapped by mmap() in p, or KERNBASE.
+// The heap must stay below it.
+uint
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint base;
+
+  base = KERNBASE;
+  for(v = p->vma; v < p->vma+NVMA; v++)
+    if(v->f && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Whether [va, va+len) lies within one of p's mappings.
+int
+mmapped(struct proc *p, uint va, uint len)
+{
+  struct vma *v;
+
+  if((v = vmafind(p, va)) == 0)
+    return 0;
+  return va + len >= va && va + len <= v->start + v->len;
+}
+
+// Write out the appends the file system is still holding in
+// memory for ip, which belong in any mapping of it.  Returns
+// whether ip can be mapped at all.
+static int
+mflush(struct inode *ip)
+{
+  int ok;
+
+  begin_op();
+  ilock(ip);
+  ok = ip->type == T_FILE;
+  if(ok)
+    iflush(ip);
+  iunlock(ip);
+  end_op();
+  return ok;
+}
+
+// Map len bytes of file f from offset off into the current
+// process, and return the address, or -1.
+int
+mmap(struct file *f, uint off, uint len, int prot, int flags)
+{
+  struct proc *curproc = myproc();
+  struct vma *v, *fv;
+  uint base;
+
+  if(f->type != FD_INODE || !f->readable || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if((prot & ~(PROT_READ|PROT_WRITE)) != 0)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  len = PGROUNDUP(len);
+  base = mmapbase(curproc);
+  if(len == 0 || len > base || base - len < PGROUNDUP(curproc->sz))
+    return -1;
+
+  fv = 0;
+  for(v = curproc->vma; v < curproc->vma+NVMA; v++)
+    if(v->f == 0){
+      fv = v;
+      break;
+    }
+  if(fv == 0)
+    return -1;
+
+  if(!mflush(f->ip))
+    return -1;
+
+  fv->f = filedup(f);
+  fv->start = base - len;
+  fv->len = len;
+  fv->off = off;
+  fv->prot = prot;
+  fv->flags = flags;
+  return fv->start;
+}
+
+// Map the page holding va in the current process, if va is in
+// one of its mappings.  Returns -1 if not, or memory is exhausted.
+int
+mmapfault(uint va)
+{
+  struct proc *curproc = myproc();
+  struct vma *v;
+  struct inode *ip;
+  char *page;
+  uint off;
+  int perm;
+
+  if((v = vmafind(curproc, va)) == 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+  off = v->off + (va - v->start);
+  ip = v->f->ip;
+
+  ilock(ip);
+  if(ip->wlen > 0){
+    // Appended to since it was mapped.
+    iunlock(ip);
+    mflush(ip);
+    ilock(ip);
+  }
+  if(BSIZE == PGSIZE && off < ip->size){
+    page = ipage(ip, off);
+    perm = PTE_U;
+    if(v->prot & PROT_WRITE)
+      perm |= v->flags == MAP_SHARED ? PTE_W : PTE_COW;
+  } else {
+    // A private copy, for small blocks or past the end of the file.
+    if((page = kalloc()) == 0){
+      iunlock(ip);
+      return -1;
+    }
+    memset(page, 0, PGSIZE);
+    if(off < ip->size)
+      readi(ip, page, off, min(PGSIZE, ip->size - off));
+    perm = PTE_U;
+    if(v->prot & PROT_WRITE)
+      perm |= PTE_W;
+  }
+  iunlock(ip);
+
+  if(mappages(curproc->pgdir, (char*)va, PGSIZE, V2P(page), perm) < 0){
+    kfree(page);
+    return -1;
+  }
+  return 0;
+}
+
+// Unmap [start, start+len) of p's mapping v, writing the pages
+// that were written back to a shared mapping's file.
+static void
+vunmap(struct proc *p, struct vma *v, uint start, uint len)
+{
+  struct inode *ip;
+  char *page;
+  uint va, off;
+  int dirty;
+
+  ip = v->f->ip;
+  for(va = start; va < start + len; va += PGSIZE){
+    if((page = unmapuvm(p->pgdir, va, &dirty)) == 0)
+      continue;
+    if(dirty && v->flags == MAP_SHARED){
+      off = v->off + (va - v->start);
+      begin_op();
+      ilock(ip);
+      if(off < ip->size)
+        writei(ip, page, off, min(PGSIZE, ip->size - off));
+      iunlock(ip);
+      end_op();
+    }
+    kfree(page);
+  }
+}
+
+// Unmap [addr, addr+len) in the current process, which must be
+// all, or the beginning or end, of one mapping.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *curproc = myproc();
+  struct vma *v;
+
+  len = PGROUNDUP(len);
+  if(addr % PGSIZE != 0 || !mmapped(curproc, addr, len))
+    return -1;
+  v = vmafind(curproc, addr);
+  if(addr != v->start && addr + len != v->start + v->len)
+    return -1;
+
+  vunmap(curproc, v, addr, len);
+  if(addr == v->start){
+    v->start += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    fileclose(v->f);
+    v->f = 0;
+  }
+  switchuvm(curproc);
+  return 0;
+}
+
+// Unmap all of p's mappings, for exec() and exit().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma+NVMA; v++){
+    if(v->f == 0)
+      continue;
+    vunmap(p, v, v->start, v->len);
+    fileclose(v->f);
+    v->f = 0;
+  }
+}
+
+// Give child np the same mappings as p, sharing the pages p has
+// mapped: a shared mapping's pages as they are, and a private
+// mapping's copy-on-write, so that np starts with what p wrote.
+// The caller must flush p's TLB.  Returns -1 if memory is
+// exhausted.
+int
+mmapdup(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+  int i;
+
+  for(v = p->vma; v < p->vma+NVMA; v++)
+    if(v->f && shareuvm(np->pgdir, p->pgdir, v->start, v->start + v->len,
+                        v->flags == MAP_PRIVATE) < 0)
+      return -1;
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].f)
+      np->vma[i].f = filedup(p->vma[i].f);
+  }
+  return 0;
+}
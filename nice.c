@@ -0,0 +1,19 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char **argv)
+{
+  int i, prio;
+
+  if(argc < 3){
+    printf(2, "usage: nice priority pid...\n");
+    exit();
+  }
+  prio = atoi(argv[1]);
+  for(i=2; i<argc; i++)
+    if(setpriority(atoi(argv[i]), prio) < 0)
+      printf(2, "nice: cannot set priority of %s\n", argv[i]);
+  exit();
+}
@@ -1,14 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define NPRIO         3  // scheduling priority levels
+#define BOOSTTICKS  100  // ticks between priority boosts
 #define NOFILE       16  // open files per process
+#define NVMA          8  // mmap() regions per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE     1024  // max size of i-node cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  16  // max # of blocks any FS op writes
+#define LOGSIZE      120  // max data blocks in on-disk log
+#ifndef NBUF
+#define NBUF         4096  // max size of disk block cache
+#endif
+#ifndef FSSIZE
+#define FSSIZE       4000  // size of file system in blocks
+#endif
 
@@ -8,21 +8,86 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// The pipe's buffer is a ring of whole pages, and bytes are
+// moved to and from it with memmove() a page-contiguous run at
+// a time.
+//
+// Whole, page-aligned pages of a process's memory are not copied
+// at all but flipped: pipewrite() puts the writer's page itself
+// in the ring, leaving it mapped copy-on-write in the writer, and
+// piperead() maps the ring's page copy-on-write in the reader,
+// giving the ring the reader's old page in exchange.  A ring page
+// may thus still be shared, and pipeown() copies it before the
+// pipe writes to it.
+#define PIPEPAGES 4
+#define PIPESIZE (PIPEPAGES*PGSIZE)
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data[PIPEPAGES];  // the ring's pages
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rbusy;      // pipegetr() has lent out the unread bytes
+  int wbusy;      // pipegetw() has lent out the free space
 };
 
+// Return the address of byte i of p's ring, and set *n to how
+// many bytes from there on are in the same page, at most max.
+static char*
+pipebyte(struct pipe *p, uint i, uint max, uint *n)
+{
+  *n = min(max, PGSIZE - i%PGSIZE);
+  return p->data[(i/PGSIZE) % PIPEPAGES] + i%PGSIZE;
+}
+
+// Make sure the pipe has the page holding byte i of its ring to
+// itself, before writing to it.
+static int
+pipeown(struct pipe *p, uint i)
+{
+  char **pg, *mem;
+
+  pg = &p->data[(i/PGSIZE) % PIPEPAGES];
+  if(krefcnt(*pg) == 1)
+    return 0;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, *pg, PGSIZE);
+  kfree(*pg);
+  *pg = mem;
+  return 0;
+}
+
+// Whether the n bytes at addr are whole pages of the current
+// process's memory, where pipes flip pages rather than copy.
+static int
+flippable(char *addr, uint n)
+{
+  uint a = (uint)addr;
+
+  return a % PGSIZE == 0 && n >= PGSIZE &&
+         a < myproc()->sz && myproc()->sz - a >= PGSIZE;
+}
+
+static void
+pipefree(struct pipe *p)
+{
+  int i;
+
+  for(i = 0; i < PIPEPAGES; i++)
+    if(p->data[i])
+      kfree(p->data[i]);
+  kfree((char*)p);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
   struct pipe *p;
+  int i;
 
   p = 0;
   *f0 = *f1 = 0;
@@ -30,10 +95,16 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((p = (struct pipe*)kalloc()) == 0)
     goto bad;
+  memset(p, 0, sizeof(*p));
+  for(i = 0; i < PIPEPAGES; i++)
+    if((p->data[i] = kalloc()) == 0)
+      goto bad;
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
   p->nread = 0;
+  p->rbusy = 0;
+  p->wbusy = 0;
   initlock(&p->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -48,7 +119,7 @@ pipealloc(struct file **f0, struct file **f1)
 //PAGEBREAK: 20
  bad:
   if(p)
-    kfree((char*)p);
+    pipefree(p);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -69,7 +140,7 @@ pipeclose(struct pipe *p, int writable)
   }
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
-    kfree((char*)p);
+    pipefree(p);
   } else
     release(&p->lock);
 }
@@ -78,11 +149,12 @@ pipeclose(struct pipe *p, int writable)
 int
 pipewrite(struct pipe *p, char *addr, int n)
 {
-  int i;
+  uint i, m;
+  char *a;
 
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
+  for(i = 0; i < n; i += m){
+    while(p->nwrite == p->nread + PIPESIZE || p->wbusy){  //DOC: pipewrite-full
       if(p->readopen == 0 || myproc()->killed){
         release(&p->lock);
         return -1;
@@ -90,7 +162,21 @@ pipewrite(struct pipe *p, char *addr, int n)
       wakeup(&p->nread);
       sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    if(p->nwrite % PGSIZE == 0 && PIPESIZE - (p->nwrite - p->nread) >= PGSIZE &&
+       flippable(addr + i, n - i) &&
+       (a = uvmshare(myproc()->pgdir, (uint)(addr + i))) != 0){
+      kfree(p->data[(p->nwrite/PGSIZE) % PIPEPAGES]);
+      p->data[(p->nwrite/PGSIZE) % PIPEPAGES] = a;
+      m = PGSIZE;
+    } else {
+      if(pipeown(p, p->nwrite) < 0){
+        release(&p->lock);
+        return -1;
+      }
+      a = pipebyte(p, p->nwrite, min(n - i, PIPESIZE - (p->nwrite - p->nread)), &m);
+      memmove(a, addr + i, m);
+    }
+    p->nwrite += m;
   }
   wakeup(&p->nread);  //DOC: pipewrite-wakeup1
   release(&p->lock);
@@ -100,22 +186,107 @@ pipewrite(struct pipe *p, char *addr, int n)
 int
 piperead(struct pipe *p, char *addr, int n)
 {
-  int i;
+  uint i, m;
+  char *a, **pg;
 
   acquire(&p->lock);
-  while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
+  while((p->nread == p->nwrite && p->writeopen) || p->rbusy){  //DOC: pipe-empty
     if(myproc()->killed){
       release(&p->lock);
       return -1;
     }
     sleep(&p->nread, &p->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
-      break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+  for(i = 0; i < n && p->nread != p->nwrite; i += m){  //DOC: piperead-copy
+    pg = &p->data[(p->nread/PGSIZE) % PIPEPAGES];
+    if(p->nread % PGSIZE == 0 && p->nwrite - p->nread >= PGSIZE &&
+       flippable(addr + i, n - i) &&
+       (a = uvmswap(myproc()->pgdir, (uint)(addr + i), *pg)) != 0){
+      *pg = a;
+      m = PGSIZE;
+    } else {
+      a = pipebyte(p, p->nread, min(n - i, p->nwrite - p->nread), &m);
+      memmove(addr + i, a, m);
+    }
+    p->nread += m;
   }
   wakeup(&p->nwrite);  //DOC: piperead-wakeup
   release(&p->lock);
   return i;
 }
+
+// Lend the caller the pipe's free space so that it can fill it
+// in place, for filesend(): wait for space, and set *addr to up
+// to n contiguous free bytes.  Return how many, or -1.  Other
+// writers wait until the caller returns the space, with the
+// number of bytes it filled, to pipeputw().
+int
+pipegetw(struct pipe *p, char **addr, int n)
+{
+  uint m;
+
+  acquire(&p->lock);
+  while(p->nwrite == p->nread + PIPESIZE || p->wbusy){
+    if(p->readopen == 0 || myproc()->killed){
+      release(&p->lock);
+      return -1;
+    }
+    wakeup(&p->nread);
+    sleep(&p->nwrite, &p->lock);
+  }
+  if(pipeown(p, p->nwrite) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  p->wbusy = 1;
+  *addr = pipebyte(p, p->nwrite, min(n, PIPESIZE - (p->nwrite - p->nread)), &m);
+  release(&p->lock);
+  return m;
+}
+
+void
+pipeputw(struct pipe *p, int n)
+{
+  acquire(&p->lock);
+  p->nwrite += n;
+  p->wbusy = 0;
+  wakeup(&p->nread);
+  wakeup(&p->nwrite);
+  release(&p->lock);
+}
+
+// Lend the caller the pipe's unread bytes so that it can use
+// them in place: wait for some, and set *addr to up to n
+// contiguous ones.  Return how many, 0 at end of file, or -1.
+// Other readers wait until the caller tells pipeputr() how many
+// it consumed.
+int
+pipegetr(struct pipe *p, char **addr, int n)
+{
+  uint m;
+
+  acquire(&p->lock);
+  while((p->nread == p->nwrite && p->writeopen) || p->rbusy){
+    if(myproc()->killed){
+      release(&p->lock);
+      return -1;
+    }
+    sleep(&p->nread, &p->lock);
+  }
+  *addr = pipebyte(p, p->nread, min(n, p->nwrite - p->nread), &m);
+  if(m > 0)
+    p->rbusy = 1;
+  release(&p->lock);
+  return m;
+}
+
+void
+pipeputr(struct pipe *p, int n)
+{
+  acquire(&p->lock);
+  p->nread += n;
+  p->rbusy = 0;
+  wakeup(&p->nwrite);
+  wakeup(&p->nread);
+  release(&p->lock);
+}
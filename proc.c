@@ -7,11 +7,42 @@
 #include "proc.h"
 #include "spinlock.h"
 
+// Sleeping processes are kept on wait queues hashed by
+// channel, so that wakeup() looks only at processes that might
+// be sleeping on its channel.  The queues are protected by
+// ptable.lock.
+#define NSLEEPQ 61
+
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct proc *sleepq[NSLEEPQ];  // lists through cnext
 } ptable;
 
+// Per-CPU queues of RUNNABLE processes, first come first
+// served within each priority level.  A process is queued on
+// the CPU that last ran it, and a CPU whose queue is empty takes
+// work from the others', so picking the next process never
+// scans ptable.  Lock order: ptable.lock, then a run queue's
+// lock.
+//
+// Scheduling is a multi-level feedback queue: a process runs
+// for a slice of SLICE(prio) clock ticks and, if it uses it all
+// up, drops a level, so CPU-bound processes sink below ones that
+// mostly sleep.  Every BOOSTTICKS ticks all processes go back
+// to their base level, which setpriority() sets, so that none
+// starves.  A process's prio and ticks are protected by the lock
+// of its CPU's run queue, and p->cpu changes only under
+// ptable.lock, so that a clock tick need not take ptable.lock.
+#define SLICE(prio) (1 << (prio))
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  volatile int n[NPRIO];       // lengths, peeked at without the lock
+} runq[NCPU];
+
 static struct proc *initproc;
 
 int nextpid = 1;
@@ -23,7 +54,91 @@ static void wakeup1(void *chan);
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+}
+
+// Append p to q at its level.  Caller holds q->lock.
+static void
+runqput(struct runq *q, struct proc *p)
+{
+  p->rqnext = 0;
+  if(q->tail[p->prio])
+    q->tail[p->prio]->rqnext = p;
+  else
+    q->head[p->prio] = p;
+  q->tail[p->prio] = p;
+  q->n[p->prio]++;
+}
+
+// Take p off the level l list of q, if it is there.
+// Caller holds q->lock.
+static int
+runqremove(struct runq *q, int l, struct proc *p)
+{
+  struct proc **pp, *prev;
+
+  prev = 0;
+  for(pp = &q->head[l]; *pp; pp = &(*pp)->rqnext){
+    if(*pp == p){
+      *pp = p->rqnext;
+      if(q->tail[l] == p)
+        q->tail[l] = prev;
+      q->n[l]--;
+      return 1;
+    }
+    prev = *pp;
+  }
+  return 0;
+}
+
+static struct proc**
+sleepq(void *chan)
+{
+  return &ptable.sleepq[(uint)chan % NSLEEPQ];
+}
+
+// Mark p RUNNABLE and queue it on its CPU.
+// The ptable lock must be held.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *q = &runq[p->cpu];
+
+  p->state = RUNNABLE;
+  acquire(&q->lock);
+  runqput(q, p);
+  release(&q->lock);
+}
+
+// Take the first process at the highest non-empty level off q,
+// or return 0 if q is empty.
+static struct proc*
+runqget(struct runq *q)
+{
+  struct proc *p;
+  int l;
+
+  for(l = 0; l < NPRIO; l++)
+    if(q->n[l] > 0)
+      break;
+  if(l == NPRIO)
+    return 0;
+  p = 0;
+  acquire(&q->lock);
+  for(l = 0; l < NPRIO && p == 0; l++){
+    if((p = q->head[l]) != 0){
+      q->head[l] = p->rqnext;
+      if(q->head[l] == 0)
+        q->tail[l] = 0;
+      q->n[l]--;
+    }
+  }
+  release(&q->lock);
+  return p;
 }
 
 // Must be called with interrupts disabled
@@ -88,6 +203,8 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->prio = p->base = 0;
+  p->ticks = 0;
 
   release(&ptable.lock);
 
@@ -148,12 +265,18 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  p->cpu = cpuid();
+  setrunnable(p);
 
   release(&ptable.lock);
 }
 
 // Grow current process's memory by n bytes.
+// Growing only reserves address space: pgfault() maps
+// zeroed pages when they are first touched.  Refuse to
+// reserve more pages than are currently free, so that
+// malloc() still sees running out of memory as a failed
+// sbrk() rather than as a fault later on.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -163,8 +286,11 @@ growproc(int n)
 
   sz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(sz + n < sz || sz + n >= mmapbase(curproc))
       return -1;
+    if((PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE > kfreecount())
+      return -1;
+    sz += n;
   } else if(n < 0){
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
@@ -190,7 +316,13 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  np->pgdir = copyuvm(curproc->pgdir, curproc->sz);
+  if(np->pgdir && mmapdup(np, curproc) < 0){
+    freevm(np->pgdir);
+    np->pgdir = 0;
+  }
+  switchuvm(curproc);  // copyuvm and mmapdup write-protected our pages
+  if(np->pgdir == 0){
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
@@ -198,6 +330,7 @@ fork(void)
   }
   np->sz = curproc->sz;
   np->parent = curproc;
+  np->prio = np->base = curproc->base;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
@@ -214,7 +347,8 @@ fork(void)
 
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  np->cpu = cpuid();
+  setrunnable(np);
 
   release(&ptable.lock);
 
@@ -234,6 +368,8 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  munmapall(curproc);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -315,7 +451,8 @@ wait(void)
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - choose a process to run: the first on this CPU's run
+//      queue, or else the first on another CPU's
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -324,34 +461,39 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int i, id = c - cpus;
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
+    if((p = runqget(&runq[id])) == 0)
+      for(i = 1; i < ncpu && p == 0; i++)
+        p = runqget(&runq[(id + i) % ncpu]);
+    if(p == 0)
+      continue;
 
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
-    }
+    // Switch to chosen process.  It is the process's job
+    // to release ptable.lock and then reacquire it
+    // before jumping back to us.  If p has only just
+    // called sched() on another CPU, this waits for that
+    // CPU to finish saving its context.
+    acquire(&ptable.lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    p->cpu = id;
+    c->proc = p;
+    switchuvm(p);
+    p->state = RUNNING;
+
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
     release(&ptable.lock);
-
   }
 }
 
@@ -386,11 +528,113 @@ void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  setrunnable(myproc());
   sched();
   release(&ptable.lock);
 }
 
+// Charge the current process for a clock tick.  Return whether
+// it should give up the CPU: because it has used up its time
+// slice, which moves it down a level, or because a process at a
+// higher level is waiting on its CPU.
+int
+preempt(void)
+{
+  struct proc *p = myproc();
+  struct runq *q;
+  int l, r;
+
+  q = &runq[p->cpu];
+  acquire(&q->lock);
+  r = 0;
+  if(++p->ticks >= SLICE(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->ticks = 0;
+    r = 1;
+  }
+  for(l = 0; l < p->prio; l++)
+    if(q->n[l] > 0)
+      r = 1;
+  release(&q->lock);
+  return r;
+}
+
+// Move every process back to its base level.
+// Called every BOOSTTICKS ticks.
+void
+prioboost(void)
+{
+  struct proc *p, *list, *next, **tail;
+  struct runq *q;
+  int l;
+
+  acquire(&ptable.lock);
+  for(q = runq; q < &runq[ncpu]; q++){
+    acquire(&q->lock);
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p->state == UNUSED || p->state == EMBRYO || &runq[p->cpu] != q)
+        continue;
+      p->prio = p->base;
+      p->ticks = 0;
+    }
+    // Gather the queue in order, then requeue it.
+    list = 0;
+    tail = &list;
+    for(l = 0; l < NPRIO; l++){
+      *tail = q->head[l];
+      if(q->head[l])
+        tail = &q->tail[l]->rqnext;
+      q->head[l] = q->tail[l] = 0;
+      q->n[l] = 0;
+    }
+    *tail = 0;
+    for(p = list; p; p = next){
+      next = p->rqnext;
+      runqput(q, p);
+    }
+    release(&q->lock);
+  }
+  release(&ptable.lock);
+}
+
+// Set the base priority level of process pid, and move it to
+// that level now.  Return the old base level, or -1.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+  struct runq *q;
+  int old;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid != pid || p->state == UNUSED)
+      continue;
+    old = p->base;
+    p->base = prio;
+    q = &runq[p->cpu];
+    acquire(&q->lock);
+    if(p->prio != prio){
+      // Requeue p at its new level, unless a scheduler has
+      // already taken it off its queue to run it.
+      if(p->state == RUNNABLE && runqremove(q, p->prio, p)){
+        p->prio = prio;
+        runqput(q, p);
+      } else
+        p->prio = prio;
+      p->ticks = 0;
+    }
+    release(&q->lock);
+    release(&ptable.lock);
+    return old;
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch here.  "Return" to user space.
 void
@@ -405,8 +649,8 @@ forkret(void)
     // of a regular process (e.g., they call sleep), and thus cannot
     // be run from main().
     first = 0;
-    iinit(ROOTDEV);
     initlog(ROOTDEV);
+    iinit(ROOTDEV);  // after recovery, which may change the bitmap
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -438,6 +682,8 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->cnext = *sleepq(chan);
+  *sleepq(chan) = p;
 
   sched();
 
@@ -457,11 +703,15 @@ sleep(void *chan, struct spinlock *lk)
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  struct proc **pp, *p;
+
+  for(pp = sleepq(chan); (p = *pp) != 0; ){
+    if(p->chan == chan){
+      *pp = p->cnext;
+      setrunnable(p);
+    } else
+      pp = &p->cnext;
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -479,15 +729,19 @@ wakeup(void *chan)
 int
 kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, **pp;
 
   acquire(&ptable.lock);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+      if(p->state == SLEEPING){
+        for(pp = sleepq(p->chan); *pp != p; pp = &(*pp)->cnext)
+          ;
+        *pp = p->cnext;
+        setrunnable(p);
+      }
       release(&ptable.lock);
       return 0;
     }
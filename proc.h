@@ -34,6 +34,16 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A file region mapped by mmap().
+struct vma {
+  struct file *f;              // Mapped file, or 0 if unused
+  uint start;                  // First address, page-aligned
+  uint len;                    // Length, a multiple of PGSIZE
+  uint off;                    // File offset mapped at start
+  int prot;                    // PROT_READ, PROT_WRITE
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -45,10 +55,17 @@ struct proc {
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *cnext;          // Next on chan's wait queue
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  struct vma vma[NVMA];        // Memory-mapped files
+  int prio;                    // Scheduling level, 0 runs first
+  int base;                    // Highest level it may have
+  int ticks;                   // Clock ticks used at this level
+  int cpu;                     // CPU whose run queue it goes on
+  struct proc *rqnext;         // Next on that run queue
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -56,3 +73,5 @@ struct proc {
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+//   ...
+//   mmap() regions, allocated downward from KERNBASE
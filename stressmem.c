@@ -0,0 +1,89 @@
+// Stress the physical page allocator from every CPU at once.
+// Each child repeatedly grows its heap by NPAGE pages, touches
+// every page, and shrinks it again, so every page costs the
+// kernel one kalloc() and one kfree().  Run it on a kernel with
+// and without per-CPU free lists to compare allocation rates.
+// xv6 has no wall clock, so rates are per timer tick.
+//
+// usage: stressmem [nchild]
+// The default is one child per possible CPU, NCPU, which
+// oversubscribes machines with fewer CPUs online.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+
+#define NCHILD  NCPU  // default: one child per possible CPU
+#define NPAGE   64    // pages per round
+#define NROUND  500   // rounds per child
+
+// Return the number of rounds completed.
+int
+churn(void)
+{
+  char *p;
+  int i, j;
+
+  for(i = 0; i < NROUND; i++){
+    p = sbrk(NPAGE*4096);
+    if(p == (char*)-1){
+      printf(1, "stressmem: sbrk failed\n");
+      break;
+    }
+    for(j = 0; j < NPAGE; j++)
+      p[j*4096] = j;
+    if(sbrk(-NPAGE*4096) == (char*)-1){
+      printf(1, "stressmem: sbrk shrink failed\n");
+      break;
+    }
+  }
+  return i;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, nchild, rounds, total, fds[2], t0, t1;
+
+  nchild = argc > 1 ? atoi(argv[1]) : NCHILD;
+  if(nchild < 1){
+    printf(2, "usage: stressmem [nchild]\n");
+    exit();
+  }
+  // Each child reports the rounds it completed, so that children
+  // that fail or are killed are not counted.
+  if(pipe(fds) < 0){
+    printf(2, "stressmem: pipe failed\n");
+    exit();
+  }
+
+  printf(1, "stressmem starting\n");
+
+  t0 = uptime();
+  for(n = 0; n < nchild; n++){
+    i = fork();
+    if(i < 0)
+      break;
+    if(i == 0){
+      close(fds[0]);
+      rounds = churn();
+      write(fds[1], &rounds, sizeof(rounds));
+      exit();
+    }
+  }
+  close(fds[1]);
+  total = 0;
+  while(read(fds[0], &rounds, sizeof(rounds)) == sizeof(rounds))
+    total += rounds;
+  close(fds[0]);
+  for(i = 0; i < n; i++)
+    wait();
+  t1 = uptime();
+
+  if(t1 == t0)
+    t1 = t0 + 1;
+  printf(1, "stressmem: %d children, %d allocations in %d ticks (%d/tick)\n",
+         n, total*NPAGE, t1 - t0, total*NPAGE / (t1 - t0));
+  exit();
+}
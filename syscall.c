@@ -54,7 +54,8 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process address space, and map any of it
+// that sbrk() reserved but the process has not touched yet.
 int
 argptr(int n, char **pp, int size)
 {
@@ -63,12 +64,26 @@ argptr(int n, char **pp, int size)
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0)
+    return -1;
+  if(((uint)i >= curproc->sz || (uint)i+size > curproc->sz) &&
+     !mmapped(curproc, i, size))
+    return -1;
+  if(touchuvm(i, size, 0) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Like argptr(), for a block of memory the system call writes.
+int
+argout(int n, char **pp, int size)
+{
+  if(argptr(n, pp, size) < 0 || touchuvm((uint)*pp, size, 1) < 0)
+    return -1;
+  return 0;
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -103,6 +118,11 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_iostat(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_sendfile(void);
+extern int sys_setpriority(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -126,6 +146,11 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_iostat]  sys_iostat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_sendfile] sys_sendfile,
+[SYS_setpriority] sys_setpriority,
 };
 
 void
@@ -20,3 +20,8 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_iostat 22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_sendfile 25
+#define SYS_setpriority 26
@@ -36,6 +36,16 @@ sys_kill(void)
   return kill(pid);
 }
 
+int
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
 int
 sys_getpid(void)
 {
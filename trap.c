@@ -53,6 +53,8 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      if(ticks % BOOSTTICKS == 0)
+        prioboost();
     }
     lapiceoi();
     break;
@@ -78,6 +80,14 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // Untouched heap pages and writes to copy-on-write pages
+    // fault, from user code or from the kernel using user memory
+    // in a system call.
+    if(myproc() != 0 && pgfault(rcr2(), tf->err) == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
@@ -100,10 +110,11 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU on clock tick, if its time
+  // slice is up or a higher-priority process is waiting.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+     tf->trapno == T_IRQ0+IRQ_TIMER && preempt())
     yield();
 
   // Check if the process has been killed since we yielded
@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct iostat;
 
 // system calls
 int fork(void);
@@ -23,6 +24,11 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int iostat(struct iostat*);
+char* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int sendfile(int, int, int);
+int setpriority(int, int);
 
 // ulib.c
 int stat(char*, struct stat*);
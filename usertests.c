@@ -184,6 +184,9 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+#define NBIG 300  // blocks in a big file
+#define NFRAG (NEXTENT + NINDIRECT + 8)  // into the double-indirect blocks
+
 void
 writetest1(void)
 {
@@ -197,9 +200,9 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
-    if(write(fd, buf, 512) != 512){
+    if(write(fd, buf, BSIZE) != BSIZE){
       printf(stdout, "error: write big file failed\n", i);
       exit();
     }
@@ -215,14 +218,14 @@ writetest1(void)
 
   n = 0;
   for(;;){
-    i = read(fd, buf, 512);
+    i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == NBIG - 1){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
       break;
-    } else if(i != 512){
+    } else if(i != BSIZE){
       printf(stdout, "read failed %d\n", i);
       exit();
     }
@@ -241,6 +244,596 @@ writetest1(void)
   printf(stdout, "big files ok\n");
 }
 
+// write two big files a block at a time, in turn, so that
+// neither's blocks are contiguous: they run out of extents
+// and need the indirect and double-indirect blocks.
+void
+fragtest(void)
+{
+  int i, j, fd[2], n;
+  char *names[] = { "frag0", "frag1" };
+
+  printf(stdout, "fragmented files test\n");
+
+  for(j = 0; j < 2; j++){
+    fd[j] = open(names[j], O_CREATE|O_RDWR);
+    if(fd[j] < 0){
+      printf(stdout, "error: creat %s failed!\n", names[j]);
+      exit();
+    }
+  }
+  for(i = 0; i < NFRAG; i++){
+    for(j = 0; j < 2; j++){
+      ((int*)buf)[0] = i;
+      ((int*)buf)[1] = j;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf(stdout, "error: write %s failed\n", names[j]);
+        exit();
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    fd[j] = open(names[j], O_RDONLY);
+    for(n = 0; (i = read(fd[j], buf, BSIZE)) == BSIZE; n++){
+      if(((int*)buf)[0] != n || ((int*)buf)[1] != j){
+        printf(stdout, "%s block %d has wrong contents\n", names[j], n);
+        exit();
+      }
+    }
+    if(i != 0 || n != NFRAG){
+      printf(stdout, "%s: read %d blocks\n", names[j], n);
+      exit();
+    }
+    close(fd[j]);
+    if(unlink(names[j]) < 0){
+      printf(stdout, "unlink %s failed\n", names[j]);
+      exit();
+    }
+  }
+  printf(stdout, "fragmented files ok\n");
+}
+
+// many small appends, which the file system stages in memory:
+// they must read back, through the same and another descriptor,
+// before and after the file is closed.
+void
+smallappends(void)
+{
+  int fd, fd1, i, j, n;
+  struct stat st;
+  char b[7];
+
+  printf(stdout, "small appends test\n");
+  unlink("appends");
+  fd = open("appends", O_CREATE|O_RDWR);
+  fd1 = open("appends", O_RDONLY);
+  if(fd < 0 || fd1 < 0){
+    printf(stdout, "error: creat appends failed!\n");
+    exit();
+  }
+  for(i = 0; i < 2000; i++){
+    for(j = 0; j < sizeof(b); j++)
+      b[j] = 'a' + (i + j) % 26;
+    if(write(fd, b, sizeof(b)) != sizeof(b)){
+      printf(stdout, "error: append %d failed\n", i);
+      exit();
+    }
+    if(i % 500 == 499){
+      if(fstat(fd1, &st) < 0 || st.size != (i+1)*sizeof(b)){
+        printf(stdout, "error: appends size %d\n", st.size);
+        exit();
+      }
+      // read the latest append, which may still be in memory
+      for(n = 0; n < i; n++)
+        if(read(fd1, b, sizeof(b)) != sizeof(b)){
+          printf(stdout, "error: read appends failed\n");
+          exit();
+        }
+      if(read(fd1, b, sizeof(b)) != sizeof(b) || b[0] != 'a' + i%26){
+        printf(stdout, "error: appends read back wrong\n");
+        exit();
+      }
+      close(fd1);
+      fd1 = open("appends", O_RDONLY);
+    }
+  }
+  close(fd);
+  close(fd1);
+
+  fd = open("appends", O_RDONLY);
+  for(i = 0; (n = read(fd, b, sizeof(b))) == sizeof(b); i++){
+    for(j = 0; j < sizeof(b); j++)
+      if(b[j] != 'a' + (i + j) % 26){
+        printf(stdout, "error: appends block %d wrong\n", i);
+        exit();
+      }
+  }
+  if(n != 0 || i != 2000){
+    printf(stdout, "error: read %d appends\n", i);
+    exit();
+  }
+  close(fd);
+  unlink("appends");
+  printf(stdout, "small appends ok\n");
+}
+
+// map a file with mmap() and use it in the ways the mapping allows.
+void
+mmaptest(void)
+{
+  int fd, fd1, i, j, pid, n;
+  char *p, *q;
+
+  printf(stdout, "mmap test\n");
+  n = 2*4096 + 100;
+  fd = open("mmapf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat mmapf failed!\n");
+    exit();
+  }
+  for(i = 0; i < n; i += 4096){
+    for(j = 0; j < 4096; j++)
+      buf[j] = 'a' + (i+j) % 23;
+    if(write(fd, buf, n - i < 4096 ? n - i : 4096) < 0){
+      printf(stdout, "error: write mmapf failed\n");
+      exit();
+    }
+  }
+
+  p = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf(stdout, "error: mmap failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++)
+    if(p[i] != 'a' + i % 23){
+      printf(stdout, "error: mmap byte %d wrong\n", i);
+      exit();
+    }
+  for(; i < 3*4096; i++)
+    if(p[i] != 0){
+      printf(stdout, "error: mmap past end of file not zero\n");
+      exit();
+    }
+  // a read-only mapping is not a place to read() into
+  if(read(fd, p, 10) != -1){
+    printf(stdout, "error: read into read-only mapping\n");
+    exit();
+  }
+  // but it is fine to write() from
+  fd1 = open("mmapf1", O_CREATE|O_RDWR);
+  if(write(fd1, p + 4096, 4096) != 4096){
+    printf(stdout, "error: write from mapping failed\n");
+    exit();
+  }
+  close(fd1);
+  fd1 = open("mmapf1", O_RDONLY);
+  if(read(fd1, buf, 4096) != 4096 || buf[0] != 'a' + 4096 % 23){
+    printf(stdout, "error: write from mapping wrong\n");
+    exit();
+  }
+  close(fd1);
+  unlink("mmapf1");
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(p[4096+1] != 'a' + (4096+1) % 23){
+      printf(stdout, "error: mmap in child wrong\n");
+    }
+    exit();
+  }
+  wait();
+  if(munmap(p, n) < 0 || munmap(p, n) != -1){
+    printf(stdout, "error: munmap\n");
+    exit();
+  }
+
+  // private writes stay private
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  q = mmap(0, n, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == (char*)-1 || q == (char*)-1){
+    printf(stdout, "error: mmap failed\n");
+    exit();
+  }
+  p[0] = 'X';
+  if(q[0] != 'a'){
+    printf(stdout, "error: private write is visible\n");
+    exit();
+  }
+  // a fork child sees the parent's private page, but still
+  // privately
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(p[0] != 'X')
+      printf(stdout, "error: private page lost in child\n");
+    p[0] = 'W';
+    exit();
+  }
+  wait();
+  if(p[0] != 'X' || q[0] != 'a'){
+    printf(stdout, "error: child's private write is visible\n");
+    exit();
+  }
+  munmap(p, n);
+
+  // shared writes reach the file
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf(stdout, "error: mmap failed\n");
+    exit();
+  }
+  p[1] = 'Y';
+  p[4096+2] = 'Z';
+  munmap(p, n);
+  munmap(q, n);
+  close(fd);
+  fd = open("mmapf", O_RDONLY);
+  if(read(fd, buf, 4096+3) != 4096+3 || buf[0] != 'a' || buf[1] != 'Y' ||
+     buf[4096+2] != 'Z'){
+    printf(stdout, "error: shared write lost\n");
+    exit();
+  }
+  close(fd);
+
+  // small appends, which the file system holds back, still show
+  // up in an existing mapping
+  fd = open("mmapf", O_RDWR);
+  p = mmap(0, 3*4096, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf(stdout, "error: mmap failed\n");
+    exit();
+  }
+  while(read(fd, buf, 4096) > 0)
+    ;
+  if(write(fd, "hello", 5) != 5 || p[n] != 'h' || p[n+4] != 'o'){
+    printf(stdout, "error: append missing from mapping\n");
+    exit();
+  }
+  munmap(p, 3*4096);
+  close(fd);
+  unlink("mmapf");
+  printf(stdout, "mmap ok\n");
+}
+
+// copy a file through a pipe and into another file with sendfile().
+void
+sendfiletest(void)
+{
+  int fd, fd1, fds[2], i, n, pid, tot;
+
+  printf(stdout, "sendfile test\n");
+  fd = open("sendf0", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat sendf0 failed!\n");
+    exit();
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 19;
+  for(i = 0; i < 3; i++)
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(stdout, "error: write sendf0 failed\n");
+      exit();
+    }
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fd = open("sendf0", O_RDONLY);
+    while((n = sendfile(fds[1], fd, 1000)) > 0)
+      ;
+    if(n < 0)
+      printf(stdout, "error: sendfile to pipe failed\n");
+    exit();
+  }
+  close(fds[1]);
+  fd1 = open("sendf1", O_CREATE|O_RDWR);
+  tot = 0;
+  while((n = sendfile(fd1, fds[0], 3000)) > 0)
+    tot += n;
+  close(fds[0]);
+  wait();
+  if(n < 0 || tot != 3*sizeof(buf)){
+    printf(stdout, "error: sendfile from pipe moved %d\n", tot);
+    exit();
+  }
+  close(fd1);
+
+  // and a file to a file
+  fd = open("sendf1", O_RDONLY);
+  fd1 = open("sendf2", O_CREATE|O_RDWR);
+  if(sendfile(fd1, fd, 3*sizeof(buf)) != 3*sizeof(buf) || sendfile(fd1, fd, 10) != 0){
+    printf(stdout, "error: sendfile between files\n");
+    exit();
+  }
+  close(fd);
+  close(fd1);
+
+  fd = open("sendf2", O_RDONLY);
+  for(tot = 0; (n = read(fd, buf, 1000)) > 0; tot += n)
+    for(i = 0; i < n; i++)
+      if(buf[i] != 'a' + ((tot + i) % sizeof(buf)) % 19){
+        printf(stdout, "error: sendfile copy wrong at %d\n", tot + i);
+        exit();
+      }
+  if(tot != 3*sizeof(buf)){
+    printf(stdout, "error: sendfile copy has %d bytes\n", tot);
+    exit();
+  }
+  close(fd);
+  unlink("sendf0");
+  unlink("sendf1");
+  unlink("sendf2");
+  printf(stdout, "sendfile ok\n");
+}
+
+// Count the free physical pages: sbrk() refuses to reserve more
+// pages than are free.
+int
+freepages(void)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = (1 << 19) - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(sbrk(mid*4096) != (char*)-1){
+      sbrk(-mid*4096);
+      lo = mid;
+    } else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// whole, page-aligned pages sent through a pipe are flipped
+// rather than copied; each side must still see its own data.
+void
+pipeflip(void)
+{
+  int fds[2], i, n, pid, before;
+  char *a, *b;
+
+  printf(stdout, "pipeflip test\n");
+  a = sbrk(0);
+  a = sbrk(4096 - (uint)a % 4096 + 8*4096);
+  if(a == (char*)-1){
+    printf(stdout, "sbrk failed\n");
+    exit();
+  }
+  a += 4096 - (uint)a % 4096;
+  b = a + 4*4096;
+  for(i = 0; i < 4*4096; i++){
+    a[i] = i % 251;
+    b[i] = 0;
+  }
+
+  // Through a pipe to ourselves: a flipped page leaves the pipe
+  // holding our page and frees the one it had, and the read
+  // hands the pipe b's old page in exchange, so four pages end
+  // up free.  Copying frees none.
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  before = freepages();
+  if(write(fds[1], a, 4*4096) != 4*4096 || read(fds[0], b, 4*4096) != 4*4096){
+    printf(stdout, "error: pipeflip to self failed\n");
+    exit();
+  }
+  if(freepages() - before < 4){
+    printf(stdout, "error: pipe copied pages rather than flipping them\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  for(i = 0; i < 4*4096; i++)
+    if(b[i] != (char)(i % 251)){
+      printf(stdout, "error: pipeflip to self data wrong at %d\n", i);
+      exit();
+    }
+  b[0] = 1;
+  if(a[0] != 0){
+    printf(stdout, "error: pipeflip pages still shared\n");
+    exit();
+  }
+
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(n = 0; n < 3; n++){
+      if(write(fds[1], a, 4*4096) != 4*4096){
+        printf(stdout, "error: pipeflip write failed\n");
+        exit();
+      }
+      // scribble on what was just sent
+      for(i = 0; i < 4*4096; i++)
+        a[i] = 'x';
+      for(i = 0; i < 4*4096; i++)
+        a[i] = (i + n + 1) % 251;
+    }
+    exit();
+  }
+  close(fds[1]);
+  for(n = 0; n < 3; n++){
+    for(i = 0; i < 4*4096; i += 4096)
+      if(read(fds[0], b + i, 4096) != 4096){
+        printf(stdout, "error: pipeflip read failed\n");
+        exit();
+      }
+    for(i = 0; i < 4*4096; i++)
+      if(b[i] != (char)((i + n) % 251)){
+        printf(stdout, "error: pipeflip data wrong at %d\n", i);
+        exit();
+      }
+    for(i = 0; i < 4*4096; i++)
+      b[i] = 0;
+  }
+  if(read(fds[0], b, 4096) != 0){
+    printf(stdout, "error: pipeflip extra data\n");
+    exit();
+  }
+  close(fds[0]);
+  wait();
+  for(i = 0; i < 4*4096; i++)
+    if(a[i] != (char)(i % 251)){
+      printf(stdout, "error: pipeflip parent's buffer changed\n");
+      exit();
+    }
+  printf(stdout, "pipeflip ok\n");
+}
+
+// setpriority(), and a process at the top level should get the
+// CPU promptly while CPU-bound ones run at the bottom: much
+// sooner than when it is down among them, as it would be with
+// round robin.
+#define NSPIN 16
+
+int
+sleepticks(int prio)
+{
+  int i, t;
+
+  setpriority(getpid(), prio);
+  t = uptime();
+  for(i = 0; i < 10; i++)
+    sleep(1);
+  t = uptime() - t;
+  setpriority(getpid(), 0);
+  return t;
+}
+
+void
+priotest(void)
+{
+  int i, pids[NSPIN], top, bottom;
+
+  printf(stdout, "priority test\n");
+  if(setpriority(getpid(), 1) != 0 || setpriority(getpid(), 0) != 1){
+    printf(stdout, "error: setpriority on self\n");
+    exit();
+  }
+  if(setpriority(getpid(), -1) != -1 || setpriority(getpid(), 3) != -1 ||
+     setpriority(-1, 0) != -1){
+    printf(stdout, "error: setpriority accepted bad arguments\n");
+    exit();
+  }
+
+  // enough spinners to keep every CPU busy
+  for(i = 0; i < NSPIN; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf(stdout, "fork failed\n");
+      exit();
+    }
+    if(pids[i] == 0)
+      for(;;)
+        ;
+    if(setpriority(pids[i], 2) != 0){
+      printf(stdout, "error: setpriority on child\n");
+      exit();
+    }
+  }
+  top = sleepticks(0);
+  bottom = sleepticks(2);
+  for(i = 0; i < NSPIN; i++){
+    kill(pids[i]);
+    wait();
+  }
+  if(2*top > bottom){
+    printf(stdout, "error: 10 sleeps took %d ticks at the top level, "
+           "%d at the bottom\n", top, bottom);
+    exit();
+  }
+  printf(stdout, "priority ok\n");
+}
+
+// more inodes in use at once than the old fixed-size inode
+// cache had room for: several processes each hold many files open.
+void
+manyinodes(void)
+{
+  int i, j, pid, fd, fds[2], ready[2];
+  char c, ok, name[4];
+
+  printf(stdout, "many inodes test\n");
+
+  if(pipe(fds) != 0 || pipe(ready) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  for(i = 0; i < 7; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      close(fds[1]);
+      close(ready[0]);
+      name[0] = 'i';
+      name[1] = '0' + i;
+      name[3] = '\0';
+      ok = 'x';
+      // 11 files, with 0, 1, 2 and the two pipe ends, fill
+      // the process's file table.
+      for(j = 0; j < 11; j++){
+        name[2] = 'a' + j;
+        if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+          printf(stdout, "many inodes: create %s failed\n", name);
+          ok = 'e';
+          break;
+        }
+        unlink(name);
+      }
+      // tell the parent how it went, and keep the files open
+      // until it is done
+      write(ready[1], &ok, 1);
+      read(fds[0], &c, 1);
+      exit();
+    }
+  }
+  close(fds[0]);
+  close(ready[1]);
+  // wait until every child has all of its files open
+  for(i = 0; i < 7; i++)
+    if(read(ready[0], &c, 1) != 1 || c != 'x'){
+      printf(stdout, "many inodes: child failed\n");
+      exit();
+    }
+  close(ready[0]);
+  close(fds[1]);
+  for(i = 0; i < 7; i++)
+    wait();
+  printf(stdout, "many inodes ok\n");
+}
+
 void
 createtest(void)
 {
@@ -1546,6 +2139,108 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// after fork, parent and child each see only their own writes
+// to a page they share copy-on-write.
+int cowvar;
+
+void
+cowtest(void)
+{
+  int a[2], b[2], pid;
+
+  printf(stdout, "cow test\n");
+  cowvar = 0;
+  if(pipe(a) != 0 || pipe(b) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    cowvar = 1;
+    write(a[1], "x", 1);
+    read(b[0], buf, 1);
+    if(cowvar != 1)
+      printf(stdout, "error: cow child sees %d\n", cowvar);
+    exit();
+  }
+  read(a[0], buf, 1);
+  if(cowvar != 0){
+    printf(stdout, "error: cow parent sees child's write\n");
+    exit();
+  }
+  cowvar = 2;
+  write(b[1], "x", 1);
+  wait();
+  if(cowvar != 2){
+    printf(stdout, "error: cow parent sees %d\n", cowvar);
+    exit();
+  }
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+  printf(stdout, "cow ok\n");
+}
+
+// sbrk() only reserves memory: untouched pages must read as
+// zero, be usable by system calls, and be shared correctly
+// with a forked child.
+void
+lazysbrktest(void)
+{
+  char *a, *oldbrk;
+  int fds[2], pid, i, amt;
+
+  printf(stdout, "lazy sbrk test\n");
+  oldbrk = sbrk(0);
+  amt = 64*1024*1024;
+  a = sbrk(amt);
+  if(a == (char*)-1){
+    printf(stdout, "lazy sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < amt; i += 1024*1024){
+    if(a[i] != 0){
+      printf(stdout, "lazy sbrk page not zero\n");
+      exit();
+    }
+    a[i] = 1;
+  }
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  write(fds[1], "x", 1);
+  if(read(fds[0], a + amt - 1, 1) != 1 || a[amt-1] != 'x'){
+    printf(stdout, "read into lazy page failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    a[amt/2 + 4096] = 2;
+    if(a[0] != 1 || a[amt-1] != 'x')
+      printf(stdout, "lazy sbrk child sees wrong data\n");
+    exit();
+  }
+  wait();
+  if(a[amt/2 + 4096] != 0){
+    printf(stdout, "lazy sbrk child write visible in parent\n");
+    exit();
+  }
+  sbrk(-(sbrk(0) - oldbrk));
+  printf(stdout, "lazy sbrk test OK\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1768,11 +2463,20 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  lazysbrktest();
+  cowtest();
   validatetest();
 
   opentest();
   writetest();
   writetest1();
+  fragtest();
+  manyinodes();
+  smallappends();
+  mmaptest();
+  sendfiletest();
+  pipeflip();
+  priotest();
   createtest();
 
   openiputtest();
@@ -57,7 +57,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
@@ -310,38 +310,209 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
+// Map the pages of [va, end) in pgdir into child page table d
+// as well.  If cow, writable pages become read-only and PTE_COW
+// in both page tables, and cowfault() copies them on the first
+// write; otherwise both keep writing the same page.  The caller
+// must flush pgdir's TLB.
+int
+shareuvm(pde_t *d, pde_t *pgdir, uint va, uint end, int cow)
+{
+  pte_t *pte;
+  uint pa, flags;
+
+  for(; va < end; va += PGSIZE){
+    // Pages that were never touched are not mapped yet.
+    if((pte = walkpgdir(pgdir, (void *) va, 0)) == 0){
+      va = PGADDR(PDX(va) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if(!(*pte & PTE_P))
+      continue;
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    pa = PTE_ADDR(*pte);
+    flags = PTE_FLAGS(*pte) & ~PTE_D;
+    if(mappages(d, (void*)va, PGSIZE, pa, flags) < 0)
+      return -1;
+    kdup(P2V(pa));
+  }
+  return 0;
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child, sharing the parent's pages
+// copy-on-write.  The caller must flush the parent's TLB.
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
-  char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
+  if(shareuvm(d, pgdir, 0, sz, 1) < 0){
+    freevm(d);
+    return 0;
+  }
+  return d;
+}
+
+// Resolve a write fault at user virtual address va on a
+// copy-on-write page by giving pgdir its own writable copy.
+// The last address space sharing a page takes it over without
+// copying.  Returns -1 if va is not a copy-on-write page or
+// memory is exhausted.
+int
+cowfault(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcnt(P2V(pa)) == 1){
+    *pte = pa | flags;
+  } else {
     if((mem = kalloc()) == 0)
-      goto bad;
+      return -1;
     memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0)
-      goto bad;
+    *pte = V2P(mem) | flags;
+    kfree(P2V(pa));
   }
-  return d;
+  invlpg((void*)va);
+  return 0;
+}
+
+// Map a zeroed page at user virtual address va.
+static int
+lazymap(pde_t *pgdir, uint va)
+{
+  char *mem;
 
-bad:
-  freevm(d);
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pgdir, (char*)PGROUNDDOWN(va), PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
   return 0;
 }
 
+// Handle a page fault at user virtual address va in the current
+// process.  A missing page below p->sz is heap that growproc()
+// reserved but nobody has touched yet, so map a zeroed page;
+// above p->sz it may belong to an mmap() region; a present page
+// may be copy-on-write, if the fault was a write.  err is the
+// fault's error code.  Returns -1 if the fault is none of these,
+// or memory is exhausted.
+int
+pgfault(uint va, uint err)
+{
+  struct proc *curproc = myproc();
+  pte_t *pte;
+
+  pte = walkpgdir(curproc->pgdir, (char*)va, 0);
+  if(pte && (*pte & PTE_P)){
+    if((err & (FEC_PR|FEC_WR)) != (FEC_PR|FEC_WR))
+      return -1;
+    return cowfault(curproc->pgdir, va);
+  }
+  if(va >= curproc->sz)
+    return mmapfault(va);
+  return lazymap(curproc->pgdir, va);
+}
+
+// Map any untouched heap or mmap() pages in the current
+// process's range [va, va+len), so that a system call can use
+// the range without faulting.  If the system call will write
+// the range, also unshare copy-on-write pages, and fail on
+// read-only ones.  Returns -1 on failure.
+int
+touchuvm(uint va, uint len, int write)
+{
+  struct proc *curproc = myproc();
+  pte_t *pte;
+  uint a;
+
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    pte = walkpgdir(curproc->pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & PTE_P) == 0){
+      if(pgfault(a, write ? FEC_WR : 0) < 0)
+        return -1;
+      pte = walkpgdir(curproc->pgdir, (char*)a, 0);
+    }
+    if(write && (*pte & PTE_W) == 0 && cowfault(curproc->pgdir, a) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Add a reference to the user page at va in pgdir and return its
+// kernel address, making pgdir's mapping copy-on-write so that
+// the page keeps its contents.  Returns 0 if there is no user
+// page at va.
+char*
+uvmshare(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  char *page;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+    return 0;
+  if(*pte & PTE_W){
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    invlpg((void*)va);
+  }
+  page = P2V(PTE_ADDR(*pte));
+  kdup(page);
+  return page;
+}
+
+// Map page, and the caller's reference to it, at user address va
+// in pgdir, copy-on-write, in place of the page there, which is
+// returned along with its reference.  Returns 0 if there is no
+// user page at va.
+char*
+uvmswap(pde_t *pgdir, uint va, char *page)
+{
+  pte_t *pte;
+  char *old;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+    return 0;
+  old = P2V(PTE_ADDR(*pte));
+  *pte = V2P(page) | PTE_P | PTE_U | PTE_COW;
+  invlpg((void*)va);
+  return old;
+}
+
+// Remove the mapping of the user page at va, if any, and return
+// its kernel address, for the caller to drop the reference;
+// set *dirty if the page was written through the mapping.
+// The caller must flush the TLB.
+char*
+unmapuvm(pde_t *pgdir, uint va, int *dirty)
+{
+  pte_t *pte;
+  char *page;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || (*pte & PTE_P) == 0)
+    return 0;
+  page = P2V(PTE_ADDR(*pte));
+  *dirty = (*pte & PTE_D) != 0;
+  *pte = 0;
+  return page;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -350,7 +521,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -360,15 +531,21 @@ uva2ka(pde_t *pgdir, char *uva)
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
 // uva2ka ensures this only works for PTE_U pages.
+// The copy goes through the kernel's mapping of the page, which
+// ignores PTE_W, so copy-on-write pages are unshared first.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if(pte && (*pte & PTE_COW) && cowfault(pgdir, va0) < 0)
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
@@ -138,6 +138,12 @@ rcr2(void)
   return val;
 }
 
+static inline void
+invlpg(void *addr)
+{
+  asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
 static inline void
 lcr3(uint val)
 {